@@ -0,0 +1,319 @@
+#include "server.hpp"
+#include "bucket.hpp"
+#include "dedupe.hpp"
+#include "helper.hpp"
+#include "json_writer.hpp"
+#include "metrics.hpp"
+#include <charconv>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+
+//-------------------------------------------------------------
+// Microbenchmarks for the IPC and dispatch hot paths. Results are written to stdout as
+// one JSON document, so runs can be kept and compared across releases:
+//
+//   katrix_bench [iterations] > bench.json
+//-------------------------------------------------------------
+namespace kiq::katrix::bench
+{
+using clock_t   = std::chrono::steady_clock;
+using buffers_t = std::vector<ipc_message::byte_buffer>;
+static const char*  g_platform{"Matrix"};
+static const size_t g_window  {512};
+static const int    g_timeout_ms{5000};
+//-------------------------------------------------------------
+struct result
+{
+  std::string                      name;
+  size_t                           ops;
+  clock_t::duration                elapsed;
+  std::shared_ptr<const histogram> latency;
+};
+//-------------------------------------------------------------
+template <typename T>
+static void keep(T&& value)
+{
+  asm volatile("" : : "g"(&value) : "memory");
+}
+//-------------------------------------------------------------
+// Runs fn(i) for the first `warmup` indices untimed, to warm caches and allocators, then
+// for all of [0, n) timed
+template <typename F>
+static result measure(std::string name, size_t n, F&& fn, size_t warmup = 1000)
+{
+  for (size_t i = 0; i < std::min(n, warmup); i++)
+    fn(i);
+
+  const auto start = clock_t::now();
+  for (size_t i = 0; i < n; i++)
+    fn(i);
+  return result{std::move(name), n, clock_t::now() - start, nullptr};
+}
+//-------------------------------------------------------------
+static std::vector<buffers_t> make_requests(const std::string& prefix, size_t n)
+{
+  std::vector<buffers_t> requests;
+  requests.reserve(n);
+  for (size_t i = 0; i < n; i++)
+    requests.push_back(platform_message{g_platform, prefix + std::to_string(i), "bench",
+                                        "Benchmark post " + std::to_string(i), "", false, 0x00,
+                                        R"({"room": "!bench:localhost"})"}.data());
+  return requests;
+}
+//-------------------------------------------------------------
+static size_t index_of(const std::string& id)
+{
+  size_t     index{0};
+  const auto pos = id.find_last_of('.');
+  std::from_chars(id.data() + pos + 1, id.data() + id.size(), index);
+  return index;
+}
+//-------------------------------------------------------------
+// kiq's side of the daemon: a DEALER sends requests to the server's ROUTER, keeping at
+// most g_window unanswered, and a ROUTER collects the replies. The server is consumed
+// and replied to on this thread, as the bot's loop would. Latency is from send until
+// get_msg hands the request over.
+//-------------------------------------------------------------
+static result round_trip(const std::string& transport, size_t n)
+{
+  const bool inproc  = transport == "inproc";
+  const auto name    = "katrix_bench_" + std::to_string(getpid());
+  auto       latency = std::make_shared<histogram>();
+
+  server_options options;
+  options.rx_addr     = inproc ? "inproc://" + name + "_rx" : "ipc:///tmp/" + name + "_rx";
+  options.tx_addr     = inproc ? "inproc://" + name + "_tx" : "ipc:///tmp/" + name + "_tx";
+  options.max_pending = g_window * 2;
+  options.rx_hwm      = 0;
+  options.tx_hwm      = 0;
+
+  const auto    requests = make_requests(transport + ".", n);
+  server        srv{options};
+  zmq::socket_t sink(srv.context(), ZMQ_ROUTER);
+  zmq::socket_t peer(srv.context(), ZMQ_DEALER);
+  sink.set(zmq::sockopt::linger,   0);
+  peer.set(zmq::sockopt::linger,   0);
+  sink.set(zmq::sockopt::rcvtimeo, g_timeout_ms);
+  sink.bind   (options.tx_addr);
+  peer.connect(options.rx_addr);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100)); // Let both connections settle
+
+  auto                 sent = std::make_unique<std::atomic<int64_t>[]>(n);
+  std::atomic<size_t>  replied{0};
+  std::atomic<bool>    failed{false};
+  const auto           start = clock_t::now();
+
+  auto sender = std::async(std::launch::async, [&]
+  {
+    for (size_t i = 0; i < n && !failed; i++)
+    {
+      while (i - replied >= g_window && !failed)
+        std::this_thread::yield();
+
+      sent[i] = clock_t::now().time_since_epoch().count();
+      const auto& frames = requests[i];
+      for (size_t j = 0; j < frames.size(); j++)
+        peer.send(zmq::buffer(frames[j].data(), frames[j].size()),
+                  j + 1 == frames.size() ? zmq::send_flags::none : zmq::send_flags::sndmore);
+    }
+  });
+
+  auto receiver = std::async(std::launch::async, [&]
+  {
+    while (replied < n)
+    {
+      buffers_t      frames;
+      zmq::message_t identity, msg;
+      if (!sink.recv(identity))
+        return void(failed = true);
+
+      for (bool more = true; more && sink.recv(msg);)
+      {
+        more = sink.get(zmq::sockopt::rcvmore);
+        frames.emplace_back(msg.data<uint8_t>(), msg.data<uint8_t>() + msg.size());
+      }
+
+      if (DeserializeIPCMessage(std::move(frames))->type() != constants::IPC_PLATFORM_INFO)
+        replied++;
+    }
+  });
+
+  for (size_t consumed = 0; consumed < n && !failed;)
+  {
+    auto msg = srv.get_msg();
+    if (!msg)
+    {
+      std::this_thread::yield();
+      continue;
+    }
+
+    const auto id = static_cast<platform_message*>(msg.get())->id();
+    latency->record(clock_t::now() - clock_t::time_point(clock_t::duration(sent[index_of(id)].load())));
+    srv.reply(id, true);
+    consumed++;
+  }
+
+  sender  .wait();
+  receiver.wait();
+  if (failed)
+    kiq::log::klog().e("Round trip over {} timed out with {} of {} replies", transport, replied.load(), n);
+
+  if (!inproc)
+  {
+    unlink(options.rx_addr.substr(6).c_str());
+    unlink(options.tx_addr.substr(6).c_str());
+  }
+
+  return result{"ipc_round_trip/" + transport, replied, clock_t::now() - start, std::move(latency)};
+}
+//-------------------------------------------------------------
+static std::vector<mtx::events::collections::TimelineEvents> make_timeline(size_t n)
+{
+  using namespace mtx::events;
+
+  std::vector<collections::TimelineEvents> events;
+  events.reserve(n);
+  for (size_t i = 0; i < n; i++)
+  {
+    switch (i % 4)
+    {
+      case 0:
+      {
+        RoomEvent<msg::Text> e;
+        e.sender       = "@bench:localhost";
+        e.content.body = "Timeline message " + std::to_string(i);
+        events.emplace_back(std::move(e));
+      }
+      break;
+      case 1:
+      {
+        RoomEvent<msg::Notice> e;
+        e.sender       = "@bench:localhost";
+        e.content.body = "Timeline notice " + std::to_string(i);
+        events.emplace_back(std::move(e));
+      }
+      break;
+      case 2:
+      {
+        RoomEvent<msg::Image> e;
+        e.sender       = "@bench:localhost";
+        e.content.body = "image.png";
+        events.emplace_back(std::move(e));
+      }
+      break;
+      default:
+      {
+        StateEvent<state::Name> e;
+        e.sender       = "@bench:localhost";
+        e.content.name = "Bench";
+        events.emplace_back(std::move(e));
+      }
+    }
+  }
+  return events;
+}
+//-------------------------------------------------------------
+static std::string report(const std::vector<result>& results)
+{
+  json_writer writer{4096};
+  writer.begin_object()
+        .field("timestamp", static_cast<int64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                              std::chrono::system_clock::now().time_since_epoch()).count()))
+        .key("benchmarks").begin_array();
+
+  for (const auto& r : results)
+  {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(r.elapsed).count();
+    writer.begin_object()
+          .field("name",        r.name)
+          .field("ops",         static_cast<int64_t>(r.ops))
+          .field("elapsed_ns",  static_cast<int64_t>(ns))
+          .field("ns_per_op",   static_cast<int64_t>(r.ops ? ns / static_cast<int64_t>(r.ops) : 0))
+          .field("ops_per_sec", static_cast<int64_t>(ns ? static_cast<double>(r.ops) * 1e9 / static_cast<double>(ns) : 0));
+    if (r.latency)
+      writer.field("p50_us", static_cast<int64_t>(r.latency->percentile(0.50)))
+            .field("p99_us", static_cast<int64_t>(r.latency->percentile(0.99)))
+            .field("max_us", static_cast<int64_t>(r.latency->max()));
+    writer.end_object();
+  }
+
+  writer.end_array().end_object();
+  return writer.str();
+}
+//-------------------------------------------------------------
+static std::vector<result> run(size_t n)
+{
+  std::vector<result> results;
+
+  results.push_back(round_trip("inproc", n));
+  results.push_back(round_trip("ipc",    n));
+
+  const auto requests = make_requests("bench.", n);
+  results.push_back(measure("deserialize", n, [&](size_t i)
+  {
+    keep(DeserializeIPCMessage(buffers_t{requests[i]}));
+  }));
+
+  std::vector<ipc_msg_t> messages;
+  messages.reserve(n + 1000);
+  for (size_t i = 0; i < n + 1000; i++)
+    messages.push_back(DeserializeIPCMessage(buffers_t{requests[i % n]}));
+  request_converter converter;
+  size_t            next{0};
+  results.push_back(measure("request_converter_receive", n, [&](size_t)
+  {
+    keep(converter.receive(std::move(messages[next++])));
+  }));
+
+  std::vector<std::string> ids;
+  ids.reserve(n);
+  for (size_t i = 0; i < n; i++)
+    ids.push_back("bench.dedupe." + std::to_string(i));
+  dedupe_index processed{65536, std::chrono::hours(24)};
+  results.push_back(measure("dedupe_insert", n, [&](size_t i)
+  {
+    keep(processed.insert(ids[i]));
+  }, 0));
+  results.push_back(measure("dedupe_duplicate", n, [&](size_t i)
+  {
+    keep(processed.insert(ids[n - 1 - (i % std::min<size_t>(n, 65536))]));
+  }));
+
+  results.push_back(measure("reply_serialize", n, [&](size_t i)
+  {
+    keep(okay_message{g_platform, ids[i]}.data());
+  }));
+
+  bucket tokens{std::chrono::nanoseconds(1), std::chrono::hours(1)};
+  results.push_back(measure("bucket_request", n, [&](size_t)
+  {
+    keep(tokens.request(1));
+  }));
+
+  const auto events = make_timeline(n);
+  size_t     bytes{0};
+  results.push_back(measure("timeline_classify", n, [&](size_t i)
+  {
+    if (is_room_message(events[i]))
+      bytes += get_body(events[i]).size();
+  }));
+  keep(bytes);
+
+  return results;
+}
+} // ns kiq::katrix::bench
+//-------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+  kiq::log::klogger::init("katrix_bench", "error");
+
+  size_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 100000;
+  if (!n)
+    n = 100000;
+
+  std::cout << kiq::katrix::bench::report(kiq::katrix::bench::run(n)) << std::endl;
+  return 0;
+}
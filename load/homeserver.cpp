@@ -0,0 +1,324 @@
+#include "homeserver.hpp"
+#include <logger.hpp>
+#include <nlohmann/json.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdexcept>
+
+namespace kiq::katrix::load
+{
+static const size_t g_max_header{64 * 1024};
+//-------------------------------------------------------------
+static const char* reason(int status)
+{
+  switch (status)
+  {
+    case 200: return "OK";
+    case 404: return "Not Found";
+    case 429: return "Too Many Requests";
+    default:  return "Error";
+  }
+}
+//-------------------------------------------------------------
+static int64_t now_ms()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+//-------------------------------------------------------------
+// A throwaway P-256 key and certificate for localhost, valid for a day
+static void use_self_signed(SSL_CTX* ctx)
+{
+  EVP_PKEY* key  = EVP_EC_gen("P-256");
+  X509*     cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj (X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj (X509_getm_notAfter (cert), 86400);
+  X509_set_pubkey (cert, key);
+
+  X509_NAME* name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_sign(cert, key, EVP_sha256());
+
+  const bool ok = SSL_CTX_use_certificate(ctx, cert) == 1 && SSL_CTX_use_PrivateKey(ctx, key) == 1;
+  X509_free    (cert);
+  EVP_PKEY_free(key);
+  if (!ok)
+    throw std::runtime_error("Failed to create a certificate for the mock homeserver");
+}
+//-------------------------------------------------------------
+static bool write_all(SSL* ssl, const std::string& data)
+{
+  for (size_t sent = 0; sent < data.size();)
+  {
+    const int n = SSL_write(ssl, data.data() + sent, static_cast<int>(data.size() - sent));
+    if (n <= 0)
+      return false;
+    sent += static_cast<size_t>(n);
+  }
+  return true;
+}
+//-------------------------------------------------------------
+// Reads from the connection into buf until it holds at least `size` bytes
+static bool fill(SSL* ssl, std::string& buf, size_t size)
+{
+  char chunk[16384];
+  while (buf.size() < size)
+  {
+    const int n = SSL_read(ssl, chunk, sizeof(chunk));
+    if (n <= 0)
+      return false;
+    buf.append(chunk, static_cast<size_t>(n));
+  }
+  return true;
+}
+//-------------------------------------------------------------
+static std::string header(const std::string& head, std::string name)
+{
+  std::string lower = head;
+  std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+  name = "\r\n" + name + ':';
+
+  const auto pos = lower.find(name);
+  if (pos == std::string::npos)
+    return "";
+
+  const auto start = head.find_first_not_of(' ', pos + name.size());
+  const auto end   = head.find("\r\n", start);
+  std::string value = head.substr(start, end - start);
+  std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return std::tolower(c); });
+  return value;
+}
+//-------------------------------------------------------------
+mock_homeserver::mock_homeserver(const homeserver_options& options)
+: options_(options),
+  ctx_    (SSL_CTX_new(TLS_server_method())),
+  fd_     (socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0))
+{
+  use_self_signed(ctx_);
+
+  const int   reuse{1};
+  sockaddr_in addr{};
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(options_.port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd_, 128) < 0)
+    throw std::runtime_error("Mock homeserver failed to listen on port " + std::to_string(options_.port));
+
+  acceptor_ = std::thread([this] { accept(); });
+  kiq::log::klog().i("Mock homeserver listening on https://127.0.0.1:{}", options_.port);
+}
+//----------------------------------
+mock_homeserver::~mock_homeserver()
+{
+  active_ = false;
+  shutdown(fd_, SHUT_RDWR);
+  if (acceptor_.joinable())
+    acceptor_.join();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const int sock : sockets_)
+      shutdown(sock, SHUT_RDWR);
+  }
+  for (auto& connection : connections_)
+    connection.join();
+
+  close(fd_);
+  SSL_CTX_free(ctx_);
+}
+//----------------------------------
+const mock_homeserver::counts& mock_homeserver::stats() const
+{
+  return counts_;
+}
+//----------------------------------
+void mock_homeserver::accept()
+{
+  while (active_)
+  {
+    const int sock = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock < 0)
+      continue;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    sockets_.push_back(sock);
+    connections_.emplace_back([this, sock]
+    {
+      SSL* ssl = SSL_new(ctx_);
+      SSL_set_fd(ssl, sock);
+      if (SSL_accept(ssl) == 1)
+        serve(ssl);
+      SSL_shutdown(ssl);
+      SSL_free(ssl);
+      close(sock);
+    });
+  }
+}
+//----------------------------------
+// HTTP/1.1 with keep-alive. Bodies are read by Content-Length or chunked encoding.
+void mock_homeserver::serve(SSL* ssl)
+{
+  std::string buf;
+  while (active_)
+  {
+    size_t end;
+    while ((end = buf.find("\r\n\r\n")) == std::string::npos)
+      if (buf.size() > g_max_header || !fill(ssl, buf, buf.size() + 1))
+        return;
+
+    const std::string head = buf.substr(0, end);
+    buf.erase(0, end + 4);
+
+    request req;
+    const auto first  = head.find(' ');
+    const auto second = head.find(' ', first + 1);
+    req.method = head.substr(0, first);
+    req.path   = head.substr(first + 1, second - first - 1);
+
+    if (header(head, "expect") == "100-continue" && !write_all(ssl, "HTTP/1.1 100 Continue\r\n\r\n"))
+      return;
+
+    if (header(head, "transfer-encoding") == "chunked")
+    {
+      for (;;)
+      {
+        size_t line;
+        while ((line = buf.find("\r\n")) == std::string::npos)
+          if (!fill(ssl, buf, buf.size() + 1))
+            return;
+
+        const size_t size = std::stoul(buf.substr(0, line), nullptr, 16);
+        if (!fill(ssl, buf, line + 2 + size + 2))
+          return;
+        req.body.append(buf, line + 2, size);
+        buf.erase(0, line + 2 + size + 2);
+        if (!size)
+          break;
+      }
+    }
+    else
+    if (const auto length = header(head, "content-length"); !length.empty())
+    {
+      const size_t size = std::stoul(length);
+      if (!fill(ssl, buf, size))
+        return;
+      req.body = buf.substr(0, size);
+      buf.erase(0, size);
+    }
+
+    const auto res = handle(req);
+    if (!write_all(ssl, "HTTP/1.1 " + std::to_string(res.status) + ' ' + reason(res.status) + "\r\n"
+                        "Content-Type: application/json\r\n"
+                        "Content-Length: " + std::to_string(res.body.size()) + "\r\n\r\n" + res.body))
+      return;
+
+    if (header(head, "connection") == "close")
+      return;
+  }
+}
+//----------------------------------
+mock_homeserver::response mock_homeserver::handle(const request& req)
+{
+  using json = nlohmann::json;
+  const auto path = req.path.substr(0, req.path.find('?'));
+
+  if (path.find("/sync") != std::string::npos)
+    return sync(req);
+
+  if (options_.latency.count())
+    std::this_thread::sleep_for(options_.latency);
+
+  if (path.find("/login") != std::string::npos)
+  {
+    if (req.method == "GET")
+      return {200, json{{"flows", {{{"type", "m.login.password"}}}}}.dump()};
+    counts_.logins++;
+    return {200, json{{"user_id", g_user}, {"access_token", "load_token"}, {"device_id", "LOAD"}}.dump()};
+  }
+
+  if (path.find("/send/") != std::string::npos)
+  {
+    const auto n = ++counts_.sends;
+    if (options_.limit_every && n % options_.limit_every == 0)
+    {
+      counts_.limited++;
+      return {429, json{{"errcode", "M_LIMIT_EXCEEDED"}, {"error", "Too Many Requests"},
+                        {"retry_after_ms", options_.retry_after.count()}}.dump()};
+    }
+    return {200, json{{"event_id", "$send" + std::to_string(++sequence_)}}.dump()};
+  }
+
+  if (path.find("/upload") != std::string::npos)
+  {
+    counts_.uploads++;
+    return {200, json{{"content_uri", "mxc://localhost/" + std::to_string(++sequence_)}}.dump()};
+  }
+
+  if (path.find("/directory/room/") != std::string::npos)
+  {
+    counts_.lookups++;
+    return {200, json{{"room_id", g_room}, {"servers", {"localhost"}}}.dump()};
+  }
+
+  if (path.find("/aliases") != std::string::npos)
+  {
+    counts_.lookups++;
+    return {200, json{{"aliases", {g_alias}}}.dump()};
+  }
+
+  counts_.other++;
+  if (path.find("/filter") != std::string::npos)
+    return {200, json{{"filter_id", "load"}}.dump()};
+  if (path.find("/presence/") != std::string::npos)
+    return {200, json{{"presence", "online"}}.dump()};
+  if (path.find("/joined_rooms") != std::string::npos)
+    return {200, json{{"joined_rooms", {g_room}}}.dump()};
+  if (path.find("/_matrix/") == std::string::npos)
+    return {404, json{{"errcode", "M_UNRECOGNIZED"}, {"error", "Unrecognized request"}}.dump()};
+  return {200, "{}"};
+}
+//----------------------------------
+// The first sync (no `since`) carries the room's state; later ones are held for
+// sync_latency and carry sync_events messages each
+mock_homeserver::response mock_homeserver::sync(const request& req)
+{
+  using json = nlohmann::json;
+  const bool initial = req.path.find("since=") == std::string::npos;
+  if (!initial)
+    std::this_thread::sleep_for(options_.sync_latency);
+  counts_.syncs++;
+
+  auto event = [this](const std::string& type, json content, const std::string& state_key = "")
+  {
+    json e{{"type", type}, {"content", std::move(content)}, {"sender", g_user},
+           {"event_id", "$sync" + std::to_string(++sequence_)}, {"origin_server_ts", now_ms()}};
+    if (type != "m.room.message")
+      e["state_key"] = state_key;
+    return e;
+  };
+
+  json state    = json::array();
+  json timeline = json::array();
+  if (initial)
+  {
+    state.push_back(event("m.room.name",            {{"name", "Load"}}));
+    state.push_back(event("m.room.canonical_alias", {{"alias", g_alias}}));
+    state.push_back(event("m.room.member",          {{"membership", "join"}}, g_user));
+  }
+  else
+    for (size_t i = 0; i < options_.sync_events; i++)
+      timeline.push_back(event("m.room.message", {{"msgtype", "m.text"}, {"body", "Load event " + std::to_string(i)}}));
+
+  return {200, json{
+    {"next_batch", "s" + std::to_string(++sequence_)},
+    {"rooms",      {{"join", {{g_room, {{"state", {{"events", std::move(state)}}}, {"timeline", {{"events", std::move(timeline)}}}}}}}}},
+    {"presence",   {{"events", json::array()}}}}.dump()};
+}
+} // ns kiq::katrix::load
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef struct ssl_st     SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+namespace kiq::katrix::load
+{
+//-------------------------------------------------------------
+struct homeserver_options
+{
+  uint16_t                  port        {8448};
+  size_t                    sync_events {10};  // Timeline events in each /sync response
+  std::chrono::milliseconds sync_latency{100}; // Each /sync is held this long, as a long poll
+  std::chrono::milliseconds latency     {0};   // Added to every other request
+  size_t                    limit_every {0};   // Every nth /send is refused with 429; 0 never
+  std::chrono::milliseconds retry_after {250};
+};
+//-------------------------------------------------------------
+// Stand-in for a Matrix homeserver, serving just what katrix_bot calls: login, sync,
+// send, upload, filters, presence and the room directory. It answers over TLS with a
+// self-signed certificate generated at start, one thread per connection.
+//-------------------------------------------------------------
+class mock_homeserver
+{
+public:
+  static constexpr const char* g_room {"!load:localhost"};
+  static constexpr const char* g_alias{"#load:localhost"};
+  static constexpr const char* g_user {"@load:localhost"};
+
+  struct counts
+  {
+    std::atomic<uint64_t> logins {0};
+    std::atomic<uint64_t> syncs  {0};
+    std::atomic<uint64_t> sends  {0};
+    std::atomic<uint64_t> limited{0};
+    std::atomic<uint64_t> uploads{0};
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<uint64_t> other  {0};
+  };
+
+  explicit mock_homeserver(const homeserver_options& options = {});
+  ~mock_homeserver();
+
+  const counts& stats() const;
+
+private:
+  struct request
+  {
+    std::string method;
+    std::string path;
+    std::string body;
+  };
+  struct response
+  {
+    int         status;
+    std::string body;
+  };
+
+  void     accept();
+  void     serve (SSL* ssl);
+  response handle(const request& req);
+  response sync  (const request& req);
+
+  homeserver_options       options_;
+  SSL_CTX*                 ctx_;
+  int                      fd_;
+  std::atomic<bool>        active_{true};
+  std::atomic<uint64_t>    sequence_{0};
+  counts                   counts_;
+  std::thread              acceptor_;
+  std::mutex               mutex_;
+  std::vector<std::thread> connections_;
+  std::vector<int>         sockets_;
+};
+} // ns kiq::katrix::load
@@ -0,0 +1,347 @@
+#include "homeserver.hpp"
+#include "json_writer.hpp"
+#include "metrics.hpp"
+#include <kproto/ipc.hpp>
+#include <logger.hpp>
+#include <nlohmann/json.hpp>
+#include <zmq.hpp>
+#include <charconv>
+#include <csignal>
+#include <fcntl.h>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//-------------------------------------------------------------
+// End-to-end load harness. Starts a mock homeserver, runs katrix_bot against it with a
+// generated config, and drives the bot as kiq would: requests go to its ROUTER and
+// replies are collected on the port its DEALER connects to. Prints one JSON report of
+// throughput, request-to-reply latency, and the bot's memory and CPU use.
+//
+//   katrix_load --bot ./katrix_bot --requests 10000 --window 256 --limit-every 50
+//-------------------------------------------------------------
+namespace kiq::katrix::load
+{
+using clock_t   = std::chrono::steady_clock;
+using buffers_t = std::vector<ipc_message::byte_buffer>;
+static const char* g_platform{"Matrix"};
+static const auto  g_idle_timeout {std::chrono::seconds(10)};
+static const auto  g_ready_timeout{std::chrono::seconds(30)};
+//-------------------------------------------------------------
+struct options
+{
+  std::string        bot;               // katrix_bot to start; empty to attach to `pid`
+  pid_t              pid        {0};
+  size_t             requests   {10000};
+  size_t             window     {256};  // Requests sent but not yet answered
+  double             rate       {0};    // Requests per second; 0 sends as fast as the window allows
+  size_t             media_every{0};    // Every nth request carries a file to upload; 0 never
+  size_t             media_bytes{65536};
+  size_t             max_sends  {8};
+  uint16_t           rx_port    {28477};
+  uint16_t           tx_port    {28478};
+  homeserver_options homeserver;
+//------------------------------------
+  static options parse(int argc, char* argv[])
+  {
+    options opts;
+    auto number = [](const char* arg, auto& out)
+    {
+      std::from_chars(arg, arg + std::char_traits<char>::length(arg), out);
+    };
+    auto millis = [&number](const char* arg, std::chrono::milliseconds& out)
+    {
+      int64_t ms{out.count()};
+      number(arg, ms);
+      out = std::chrono::milliseconds(ms);
+    };
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+      const std::string_view flag{argv[i]};
+      const char*            arg = argv[i + 1];
+      if      (flag == "--bot")          opts.bot = arg;
+      else if (flag == "--pid")          number(arg, opts.pid);
+      else if (flag == "--requests")     number(arg, opts.requests);
+      else if (flag == "--window")       number(arg, opts.window);
+      else if (flag == "--rate")         opts.rate = std::strtod(arg, nullptr);
+      else if (flag == "--media-every")  number(arg, opts.media_every);
+      else if (flag == "--media-bytes")  number(arg, opts.media_bytes);
+      else if (flag == "--max-sends")    number(arg, opts.max_sends);
+      else if (flag == "--rx-port")      number(arg, opts.rx_port);
+      else if (flag == "--tx-port")      number(arg, opts.tx_port);
+      else if (flag == "--port")         number(arg, opts.homeserver.port);
+      else if (flag == "--sync-events")  number(arg, opts.homeserver.sync_events);
+      else if (flag == "--sync-latency") millis(arg, opts.homeserver.sync_latency);
+      else if (flag == "--latency")      millis(arg, opts.homeserver.latency);
+      else if (flag == "--limit-every")  number(arg, opts.homeserver.limit_every);
+      else if (flag == "--retry-after")  millis(arg, opts.homeserver.retry_after);
+      else
+        kiq::log::klog().w("Ignoring unknown option {}", flag);
+    }
+    opts.window = std::max(opts.window, size_t{1});
+    return opts;
+  }
+};
+//-------------------------------------------------------------
+// CPU seconds (user + system) and resident set in kB, current and peak, from /proc
+struct usage
+{
+  double   cpu{0};
+  uint64_t rss{0};
+  uint64_t peak_rss{0};
+
+  static usage of(pid_t pid)
+  {
+    usage       u;
+    std::string line;
+    const auto  dir = "/proc/" + std::to_string(pid);
+
+    if (std::ifstream stat{dir + "/stat"}; std::getline(stat, line))
+    {
+      std::istringstream fields{line.substr(line.rfind(')') + 2)};
+      std::string        field;
+      uint64_t           utime{0}, stime{0};
+      for (int i = 3; i <= 15 && fields >> field; i++)
+        if (i == 14) utime = std::stoull(field);
+        else if (i == 15) stime = std::stoull(field);
+      u.cpu = static_cast<double>(utime + stime) / static_cast<double>(sysconf(_SC_CLK_TCK));
+    }
+
+    for (std::ifstream status{dir + "/status"}; std::getline(status, line);)
+      if (line.starts_with("VmRSS:"))
+        u.rss = std::stoull(line.substr(6));
+      else
+      if (line.starts_with("VmHWM:"))
+        u.peak_rss = std::stoull(line.substr(6));
+    return u;
+  }
+};
+//-------------------------------------------------------------
+static std::string write_config(const std::string& dir, const options& opts)
+{
+  const auto path = dir + "/katrix.json";
+  std::ofstream{path} << nlohmann::json{
+    {"server",      "127.0.0.1"},
+    {"port",        opts.homeserver.port},
+    {"verify_tls",  false},
+    {"user",        "load"},
+    {"pass",        "load"},
+    {"room",        mock_homeserver::g_room},
+    {"session",     dir + "/katrix.session"},
+    {"media_cache", dir + "/katrix.media"},
+    {"scheduled",   dir + "/katrix.scheduled"},
+    {"alias_cache", dir + "/katrix.aliases"},
+    {"max_sends",   opts.max_sends},
+    {"ipc", {{"rx_addr",     "tcp://127.0.0.1:" + std::to_string(opts.rx_port)},
+             {"tx_addr",     "tcp://127.0.0.1:" + std::to_string(opts.tx_port)},
+             {"max_pending", std::max(opts.window * 2, size_t{1024})}}}}.dump(2);
+  return path;
+}
+//-------------------------------------------------------------
+static pid_t start_bot(const std::string& bot, const std::string& dir, const std::string& config)
+{
+  const pid_t pid = fork();
+  if (pid == 0)
+  {
+    const int log = open((dir + "/katrix_bot.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(log, STDOUT_FILENO);
+    dup2(log, STDERR_FILENO);
+    if (chdir(dir.c_str()) == 0)
+      execl(bot.c_str(), bot.c_str(), config.c_str(), nullptr);
+    _exit(127);
+  }
+  return pid;
+}
+//-------------------------------------------------------------
+static void stop_bot(pid_t pid)
+{
+  kill(pid, SIGTERM);
+  for (int i = 0; i < 50; i++)
+  {
+    if (waitpid(pid, nullptr, WNOHANG) == pid)
+      return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+//-------------------------------------------------------------
+static size_t index_of(const std::string& id)
+{
+  size_t     index{0};
+  const auto pos = id.find_last_of('.');
+  std::from_chars(id.data() + pos + 1, id.data() + id.size(), index);
+  return index;
+}
+//-------------------------------------------------------------
+struct producer_result
+{
+  size_t            replied{0};
+  size_t            failed {0};
+  clock_t::duration elapsed{};
+};
+//-------------------------------------------------------------
+// Sends opts.requests posts with at most opts.window unanswered, paced to opts.rate when
+// set, and records the time from each send until its reply arrives
+static producer_result produce(zmq::socket_t& peer, zmq::socket_t& sink, const options& opts,
+                               const std::string& media, histogram& latency)
+{
+  const size_t         n    = opts.requests;
+  auto                 sent = std::make_unique<std::atomic<int64_t>[]>(n);
+  std::atomic<size_t>  replied{0};
+  std::atomic<size_t>  failed{0};
+  std::atomic<bool>    stalled{false};
+  const auto           start = clock_t::now();
+
+  auto sender = std::async(std::launch::async, [&]
+  {
+    for (size_t i = 0; i < n && !stalled; i++)
+    {
+      while (i - replied >= opts.window && !stalled)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      if (opts.rate > 0)
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<clock_t::duration>(
+                                        std::chrono::duration<double>(static_cast<double>(i) / opts.rate)));
+
+      const bool with_media = opts.media_every && i % opts.media_every == 0;
+      const auto frames     = platform_message{g_platform, "load." + std::to_string(i), "load",
+                                               "Load test post " + std::to_string(i), with_media ? media : "",
+                                               false, 0x00, mock_homeserver::g_room}.data();
+      sent[i] = clock_t::now().time_since_epoch().count();
+      for (size_t j = 0; j < frames.size(); j++)
+        peer.send(zmq::buffer(frames[j].data(), frames[j].size()),
+                  j + 1 == frames.size() ? zmq::send_flags::none : zmq::send_flags::sndmore);
+    }
+  });
+
+  sink.set(zmq::sockopt::rcvtimeo, static_cast<int>(std::chrono::milliseconds(g_idle_timeout).count()));
+  while (replied < n)
+  {
+    buffers_t      frames;
+    zmq::message_t identity, msg;
+    if (!sink.recv(identity))
+    {
+      kiq::log::klog().e("No reply for {} s. Stopping with {} of {} answered", g_idle_timeout.count(), replied.load(), n);
+      stalled = true;
+      break;
+    }
+
+    for (bool more = true; more && sink.recv(msg);)
+    {
+      more = sink.get(zmq::sockopt::rcvmore);
+      frames.emplace_back(msg.data<uint8_t>(), msg.data<uint8_t>() + msg.size());
+    }
+
+    const auto reply = DeserializeIPCMessage(std::move(frames));
+    std::string id;
+    if (reply->type() == constants::IPC_OK_TYPE)
+      id = static_cast<okay_message*>(reply.get())->id();
+    else
+    if (reply->type() == constants::IPC_FAIL_TYPE)
+    {
+      id = static_cast<fail_message*>(reply.get())->id();
+      failed++;
+    }
+    else
+      continue;                                  // matrix:busy and matrix:credit
+
+    if (const auto i = index_of(id); i < n)
+      latency.record(clock_t::now() - clock_t::time_point(clock_t::duration(sent[i].load())));
+    replied++;
+  }
+
+  sender.wait();
+  return producer_result{replied, failed, clock_t::now() - start};
+}
+//-------------------------------------------------------------
+static int run(const options& opts)
+{
+  char        tmp[] = "/tmp/katrix_load.XXXXXX";
+  const auto  dir   = std::string{mkdtemp(tmp)};
+  std::string media;
+  if (opts.media_every)
+  {
+    media = dir + "/load.bin";
+    std::ofstream{media, std::ios::binary} << std::string(opts.media_bytes, 'k');
+  }
+
+  mock_homeserver homeserver{opts.homeserver};
+  zmq::context_t  context{1};
+  zmq::socket_t   sink(context, ZMQ_ROUTER);
+  zmq::socket_t   peer(context, ZMQ_DEALER);
+  sink.set(zmq::sockopt::linger, 0);
+  peer.set(zmq::sockopt::linger, 0);
+  sink.set(zmq::sockopt::rcvhwm, 0);
+  peer.set(zmq::sockopt::sndhwm, 0);
+  sink.bind   ("tcp://127.0.0.1:" + std::to_string(opts.tx_port));
+  peer.connect("tcp://127.0.0.1:" + std::to_string(opts.rx_port));
+
+  const pid_t pid = opts.bot.empty() ? opts.pid : start_bot(opts.bot, dir, write_config(dir, opts));
+  if (pid <= 0)
+  {
+    kiq::log::klog().e("Pass --bot to start katrix_bot, or --pid of a running one");
+    return 1;
+  }
+
+  const auto deadline = clock_t::now() + g_ready_timeout;
+  while (homeserver.stats().syncs < 2 && clock_t::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  if (homeserver.stats().syncs < 2)
+    kiq::log::klog().w("Bot has not synced after {} s. Starting anyway", g_ready_timeout.count());
+
+  histogram  latency;
+  const auto before = usage::of(pid);
+  const auto result = produce(peer, sink, opts, media, latency);
+  const auto after  = usage::of(pid);
+
+  const auto   ms      = std::chrono::duration_cast<std::chrono::milliseconds>(result.elapsed).count();
+  const double seconds = std::max(static_cast<double>(ms) / 1000.0, 1e-3);
+  const auto&  hs      = homeserver.stats();
+  json_writer  writer{1024};
+  writer.begin_object()
+        .field("requests",        static_cast<int64_t>(opts.requests))
+        .field("replied",         static_cast<int64_t>(result.replied))
+        .field("failed",          static_cast<int64_t>(result.failed))
+        .field("elapsed_ms",      static_cast<int64_t>(ms))
+        .field("requests_per_sec", static_cast<int64_t>(static_cast<double>(result.replied) / seconds))
+        .key("latency_us").begin_object()
+          .field("p50", static_cast<int64_t>(latency.percentile(0.50)))
+          .field("p90", static_cast<int64_t>(latency.percentile(0.90)))
+          .field("p99", static_cast<int64_t>(latency.percentile(0.99)))
+          .field("max", static_cast<int64_t>(latency.max()))
+        .end_object()
+        .key("bot").begin_object()
+          .field("pid",          static_cast<int64_t>(pid))
+          .field("rss_kb",       static_cast<int64_t>(after.rss))
+          .field("peak_rss_kb",  static_cast<int64_t>(after.peak_rss))
+          .field("cpu_ms",       static_cast<int64_t>((after.cpu - before.cpu) * 1000))
+          .field("cpu_percent",  static_cast<int64_t>((after.cpu - before.cpu) * 100 / seconds))
+        .end_object()
+        .key("homeserver").begin_object()
+          .field("logins",  static_cast<int64_t>(hs.logins.load()))
+          .field("syncs",   static_cast<int64_t>(hs.syncs.load()))
+          .field("sends",   static_cast<int64_t>(hs.sends.load()))
+          .field("limited", static_cast<int64_t>(hs.limited.load()))
+          .field("uploads", static_cast<int64_t>(hs.uploads.load()))
+          .field("lookups", static_cast<int64_t>(hs.lookups.load()))
+        .end_object()
+        .field("workdir", dir)
+        .end_object();
+  std::cout << writer.str() << std::endl;
+
+  if (!opts.bot.empty())
+    stop_bot(pid);
+  return result.replied == opts.requests ? 0 : 2;
+}
+} // ns kiq::katrix::load
+//-------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+  kiq::log::klogger::init("katrix_load", "info");
+  signal(SIGPIPE, SIG_IGN);
+  return kiq::katrix::load::run(kiq::katrix::load::options::parse(argc, argv));
+}
@@ -0,0 +1,132 @@
+#include "alias_cache.hpp"
+#include "session.hpp"
+#include <fstream>
+#include <sstream>
+#include <logger.hpp>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+static int64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+//-------------------------------------------------------------
+alias_cache::alias_cache(const alias_options& options)
+: options_(options)
+{
+  load();
+}
+//----------------------------------
+// Returns true if the caller should look the room up, which it must then complete with
+// store() or fail(). False while a result is fresh or another lookup is outstanding.
+bool alias_cache::acquire(const std::string& room)
+{
+  entry& e = entries_[room];
+  if (e.in_flight || (!e.stale && e.expires > now()))
+    return false;
+
+  e.in_flight = true;
+  e.stale     = false;
+  return true;
+}
+//----------------------------------
+void alias_cache::store(const std::string& room, std::vector<std::string> aliases)
+{
+  entry&     e   = entries_[room];
+  const auto ttl = aliases.empty() ? options_.negative_ttl : options_.ttl;
+  e.expires   = e.stale ? 0 : now() + ttl.count();
+  e.aliases   = std::move(aliases);
+  e.in_flight = false;
+  e.stale     = false;
+  dirty_      = true;
+}
+//----------------------------------
+void alias_cache::fail(const std::string& room)
+{
+  entry& e    = entries_[room];
+  e.expires   = now() + options_.retry.count();
+  e.in_flight = false;
+  e.stale     = false;
+}
+//----------------------------------
+// A lookup already in flight may predate the change, so its result is kept but not trusted
+void alias_cache::invalidate(const std::string& room)
+{
+  if (const auto it = entries_.find(room); it != entries_.end())
+  {
+    it->second.stale = true;
+    dirty_           = true;
+  }
+}
+//----------------------------------
+const std::vector<std::string>* alias_cache::find(const std::string& room) const
+{
+  const auto it = entries_.find(room);
+  return (it != entries_.end() && it->second.expires) ? &it->second.aliases : nullptr;
+}
+//----------------------------------
+size_t alias_cache::size() const
+{
+  return entries_.size();
+}
+//----------------------------------
+bool alias_cache::dirty() const
+{
+  return dirty_;
+}
+//----------------------------------
+// <room> <expires> <alias>...
+void alias_cache::load()
+{
+  std::ifstream file{options_.path};
+  if (options_.path.empty() || !file)
+    return;
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream ss{line};
+    std::string        room, alias;
+    entry              e;
+    if (!(ss >> room >> e.expires))
+      continue;
+    while (ss >> alias)
+      e.aliases.push_back(std::move(alias));
+    entries_.insert_or_assign(std::move(room), std::move(e));
+  }
+
+  kiq::log::klog().d("Loaded {} cached room aliases from {}", entries_.size(), options_.path);
+}
+//----------------------------------
+std::string alias_cache::snapshot()
+{
+  std::string data;
+  data.reserve(entries_.size() * 96);
+  for (const auto& [room, e] : entries_)
+  {
+    if (!e.expires)
+      continue;
+
+    data += room + '\t' + std::to_string(e.stale ? 0 : e.expires);
+    for (const auto& alias : e.aliases)
+      data += '\t' + alias;
+    data += '\n';
+  }
+
+  dirty_ = false;
+  return data;
+}
+//----------------------------------
+bool alias_cache::write(const std::string& data) const
+{
+  if (options_.path.empty())
+    return true;
+
+  if (write_file(options_.path, data))
+    return true;
+
+  kiq::log::klog().w("Failed to write alias cache to {}", options_.path);
+  return false;
+}
+} // ns kiq::katrix
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+struct alias_options
+{
+  std::string          path        {"katrix.aliases"};
+  std::chrono::seconds ttl         {std::chrono::hours(24)};   // Rooms with aliases
+  std::chrono::seconds negative_ttl{std::chrono::hours(1)};    // Rooms without any
+  std::chrono::seconds retry       {std::chrono::minutes(5)};  // After a failed lookup
+};
+//-------------------------------------------------------------
+// Published aliases per room, as returned by the directory. Results, empty ones included,
+// are kept until their TTL lapses or a canonical alias change invalidates them, and only
+// one lookup per room may be in flight. Entries persist in a tab separated file, which
+// write() saves from a snapshot() so the file I/O can run on a worker thread.
+//-------------------------------------------------------------
+class alias_cache
+{
+struct entry
+{
+  std::vector<std::string> aliases;
+  int64_t                  expires  {0};
+  bool                     in_flight{false};
+  bool                     stale    {false};
+};
+//------------------------------------
+public:
+  explicit alias_cache(const alias_options& options = {});
+
+  bool                            acquire   (const std::string& room);
+  void                            store     (const std::string& room, std::vector<std::string> aliases);
+  void                            fail      (const std::string& room);
+  void                            invalidate(const std::string& room);
+  const std::vector<std::string>* find      (const std::string& room) const;
+  size_t                          size      () const;
+  bool                            dirty     () const;
+  std::string                     snapshot  ();
+  bool                            write     (const std::string& data) const;
+
+  template <typename F>
+  void for_each(F&& fn) const
+  {
+    for (const auto& [room, e] : entries_)
+      if (!e.aliases.empty())
+        fn(room, e.aliases);
+  }
+
+private:
+  void load();
+
+  alias_options                          options_;
+  std::unordered_map<std::string, entry> entries_;
+  bool                                   dirty_{false};
+};
+} // ns kiq::katrix
@@ -0,0 +1,36 @@
+#include "alloc_stats.hpp"
+#include <cstdlib>
+#include <new>
+
+namespace kiq::katrix::alloc_stats
+{
+#ifdef KATRIX_ALLOC_STATS
+static thread_local uint64_t g_count{0};
+//-------------------------------------------------------------
+uint64_t count()   { return g_count; }
+bool     enabled() { return true;    }
+} // ns kiq::katrix::alloc_stats
+//-------------------------------------------------------------
+void* operator new(std::size_t size)
+{
+  kiq::katrix::alloc_stats::g_count++;
+  if (void* ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc{};
+}
+//----------------------------------
+void* operator new[](std::size_t size)
+{
+  return ::operator new(size);
+}
+//----------------------------------
+void operator delete  (void* ptr)              noexcept { std::free(ptr); }
+void operator delete[](void* ptr)              noexcept { std::free(ptr); }
+void operator delete  (void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+#else
+//-------------------------------------------------------------
+uint64_t count()   { return 0;     }
+bool     enabled() { return false; }
+} // ns kiq::katrix::alloc_stats
+#endif
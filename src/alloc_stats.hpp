@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+
+namespace kiq::katrix::alloc_stats
+{
+//-------------------------------------------------------------
+// Heap allocations made by the calling thread. Counting replaces the global operator new
+// and is compiled in only with KATRIX_ALLOC_STATS; otherwise this always returns zero.
+//-------------------------------------------------------------
+uint64_t count();
+bool     enabled();
+} // ns kiq::katrix::alloc_stats
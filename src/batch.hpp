@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//-------------------------------------------------------------
+// Batch envelope, used in both directions over the IPC sockets. A batch is one multipart
+// message whose frames are:
+//
+//   "KIQ_BATCH" | N | n1 | <n1 frames of message 1> | ... | nN | <nN frames of message N>
+//
+// N and each ni are ASCII decimal. Each inner message is framed exactly as if it were
+// sent on its own. A multipart message whose first frame is not the magic is a single
+// message.
+//-------------------------------------------------------------
+namespace kiq::katrix::batch
+{
+static constexpr std::string_view g_magic{"KIQ_BATCH"};
+//-------------------------------------------------------------
+template <typename Buffer>
+Buffer make_frame(std::string_view s)
+{
+  return Buffer(s.begin(), s.end());
+}
+//-------------------------------------------------------------
+template <typename Buffer>
+bool read_count(const Buffer& frame, size_t& count)
+{
+  const auto* begin = reinterpret_cast<const char*>(frame.data());
+  const auto  res   = std::from_chars(begin, begin + frame.size(), count);
+  return res.ec == std::errc{} && res.ptr == begin + frame.size();
+}
+//-------------------------------------------------------------
+template <typename Buffer>
+bool is_batch(const std::vector<Buffer>& frames)
+{
+  return !frames.empty() && frames.front().size() == g_magic.size() &&
+         std::equal(g_magic.begin(), g_magic.end(), reinterpret_cast<const char*>(frames.front().data()));
+}
+//-------------------------------------------------------------
+// Returns the messages of a batch, or nothing if the envelope is malformed. The counts
+// come from the peer, so none is trusted beyond the frames actually received, and an
+// empty inner message is malformed.
+template <typename Buffer>
+std::vector<std::vector<Buffer>> split(std::vector<Buffer>&& frames)
+{
+  std::vector<std::vector<Buffer>> messages;
+  size_t                           count;
+  if (frames.size() < 2 || !read_count(frames[1], count))
+    return {};
+
+  messages.reserve(std::min(count, frames.size()));
+  for (size_t i = 2, n; messages.size() < count; i += n)
+  {
+    if (i >= frames.size() || !read_count(frames[i++], n) || !n || n > frames.size() - i)
+      return {};
+
+    messages.emplace_back(std::make_move_iterator(frames.begin() + i), std::make_move_iterator(frames.begin() + i + n));
+  }
+
+  return messages;
+}
+//-------------------------------------------------------------
+template <typename Buffer>
+std::vector<Buffer> join(std::vector<std::vector<Buffer>>&& messages)
+{
+  size_t total{2};
+  for (const auto& msg : messages)
+    total += msg.size() + 1;
+
+  std::vector<Buffer> frames;
+  frames.reserve(total);
+  frames.push_back(make_frame<Buffer>(g_magic));
+  frames.push_back(make_frame<Buffer>(std::to_string(messages.size())));
+  for (auto& msg : messages)
+  {
+    frames.push_back(make_frame<Buffer>(std::to_string(msg.size())));
+    for (auto& frame : msg)
+      frames.push_back(std::move(frame));
+  }
+
+  return frames;
+}
+} // ns kiq::katrix::batch
@@ -0,0 +1,444 @@
+#include "broker.hpp"
+#include "batch.hpp"
+#include "worker.hpp"
+#include <algorithm>
+#include <logger.hpp>
+#include <nlohmann/json.hpp>
+
+static const char* g_platform{"Matrix"};
+static const char* g_busy    {"matrix:busy"};
+static const char* g_credit  {"matrix:credit"};
+static const int   g_poll_ms{100};
+//----------------------------------------------------------------
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+static std::vector<ipc_message::byte_buffer> make_credit(const std::string& type, size_t credit, size_t depth)
+{
+  const auto info = nlohmann::json{{"credit", credit}, {"depth", depth}}.dump();
+  return platform_info(g_platform, info, type).data();
+}
+//-------------------------------------------------------------
+broker::broker(const server_options& front, const broker_options& options)
+: front_  (front),
+  options_(options),
+  context_{1},
+  rx_     (context_, ZMQ_ROUTER),
+  tx_     (context_, ZMQ_DEALER),
+  workers_(context_, ZMQ_ROUTER),
+  ring_   (options.replicas)
+{
+  for (auto* socket : {&rx_, &tx_, &workers_})
+  {
+    socket->set(zmq::sockopt::linger,              0);
+    socket->set(zmq::sockopt::tcp_keepalive,       1);
+    socket->set(zmq::sockopt::tcp_keepalive_idle,  300);
+    socket->set(zmq::sockopt::tcp_keepalive_intvl, 300);
+    socket->set(zmq::sockopt::sndtimeo,            0); // Full peers are queued for, never waited on
+  }
+  rx_     .set(zmq::sockopt::routing_id,     "katrix_daemon");
+  tx_     .set(zmq::sockopt::routing_id,     "katrix_daemon_tx");
+  rx_     .set(zmq::sockopt::rcvhwm,         front.rx_hwm);
+  tx_     .set(zmq::sockopt::sndhwm,         front.tx_hwm);
+  workers_.set(zmq::sockopt::router_mandatory, 1);
+
+  rx_     .bind   (front.rx_addr);
+  tx_     .connect(front.tx_addr);
+  workers_.bind   (options.workers_addr);
+  kiq::log::klog().i("Broker listening on {} for kiq and {} for workers", front.rx_addr, options.workers_addr);
+}
+//----------------------------------
+void broker::run()
+{
+  zmq::pollitem_t     items[] = {{rx_.handle(), 0, ZMQ_POLLIN, 0}, {workers_.handle(), 0, ZMQ_POLLIN, 0}};
+  clock_t::time_point swept   = clock_t::now();
+
+  while (active_)
+  {
+    zmq::poll(items, 2, std::chrono::milliseconds(g_poll_ms));
+
+    if (items[0].revents & ZMQ_POLLIN)
+      from_kiq();
+
+    if (items[1].revents & ZMQ_POLLIN)
+      from_worker();
+
+    flush();
+    pace();
+
+    if (const auto now = clock_t::now(); now - swept >= std::chrono::milliseconds(g_poll_ms))
+    {
+      expire();
+      swept = now;
+    }
+  }
+}
+//----------------------------------
+void broker::stop()
+{
+  active_ = false;
+}
+//----------------------------------
+bool broker::recv(zmq::socket_t& socket, std::string& identity, buffers_t& frames)
+{
+  zmq::message_t msg;
+  if (!socket.recv(msg, zmq::recv_flags::dontwait))
+    return false;
+  identity.assign(msg.data<char>(), msg.size());
+
+  for (int more_flag = socket.get(zmq::sockopt::rcvmore); more_flag && socket.recv(msg);)
+  {
+    more_flag = socket.get(zmq::sockopt::rcvmore);
+    frames.emplace_back(msg.data<uint8_t>(), msg.data<uint8_t>() + msg.size());
+  }
+  return !frames.empty();
+}
+//----------------------------------
+// A ROUTER with router_mandatory refuses the identity frame with EAGAIN when the peer is
+// at its high-water mark, and throws EHOSTUNREACH when there is no such peer
+broker::sent_t broker::send(zmq::socket_t& socket, const buffers_t& frames, const std::string* identity)
+{
+  try
+  {
+    if (identity && !socket.send(zmq::buffer(*identity), zmq::send_flags::sndmore))
+      return sent_t::full;
+
+    for (size_t i = 0; i < frames.size(); i++)
+      if (!socket.send(zmq::buffer(frames[i].data(), frames[i].size()),
+                       i + 1 == frames.size() ? zmq::send_flags::none : zmq::send_flags::sndmore))
+        return sent_t::full;
+  }
+  catch (const zmq::error_t& e)
+  {
+    kiq::log::klog().w("Failed to send: {}", e.what());
+    return sent_t::gone;
+  }
+  return sent_t::ok;
+}
+//----------------------------------
+void broker::from_kiq()
+{
+  std::string identity;
+  buffers_t   frames;
+  if (!recv(rx_, identity, frames))
+    return;
+
+  if (!batch::is_batch(frames))
+    return dispatch(std::move(frames));
+
+  auto messages = batch::split(std::move(frames));
+  if (messages.empty())
+    return kiq::log::klog().e("Received malformed batch");
+
+  for (auto& message : messages)
+    dispatch(std::move(message));
+}
+//----------------------------------
+// Posts are keyed by room, info requests by their type. Only posts are tracked, since
+// only their replies carry the request id. The broker cannot resolve aliases, and an
+// alias and its room id would hash to different workers, so posts must name room ids.
+void broker::dispatch(buffers_t&& frames)
+{
+  const auto req = converter_.receive(DeserializeIPCMessage(buffers_t{frames}));
+  if (!req)
+    return kiq::log::klog().w("Broker ignoring message which is not a request");
+
+  if (!req->info && req->room.starts_with('#'))
+  {
+    kiq::log::klog().e("Request {} names alias {}. The broker needs a room id", req->id, req->room);
+    return fail(req->id);
+  }
+
+  const auto& key     = req->info ? req->text : req->room;
+  const auto  resent  = req->info ? pending_.end() : pending_.find(req->id);
+  std::string target  = ring_.find(key);
+  if (resent != pending_.end() && members_.contains(resent->second.worker)) // Its dedupe sees the retry
+    target = resent->second.worker;
+  else
+  if (const auto it = pins_.find(key); !req->info && it != pins_.end() && members_.contains(it->second.worker))
+    target = it->second.worker;
+
+  if (target.empty())
+  {
+    kiq::log::klog().e("No workers to take request {}", req->id);
+    if (!req->info)
+      fail(req->id);
+    return;
+  }
+
+  if (const auto it = failed_.find(req->id); it != failed_.end() && it->second.worker == target)
+    failed_.erase(it);                                                      // Resent: its reply is wanted again
+
+  auto&      member = members_[target];
+  const auto sent   = member.backlog.empty() ? send(workers_, frames, &target) : sent_t::full;
+  if (sent == sent_t::gone)
+  {
+    drop(target);
+    return dispatch(std::move(frames));
+  }
+
+  if (sent == sent_t::full)
+  {
+    if (member.backlog.size() >= options_.backlog)
+    {
+      kiq::log::klog().e("Worker {} is full. Failing request {}", target, req->id);
+      if (!req->info)
+        fail(req->id);
+      return;
+    }
+    member.backlog.push_back(std::move(frames));
+  }
+
+  kiq::log::klog().t("Request {} for {} {} {}", req->id, key, sent == sent_t::ok ? "sent to" : "held for", target);
+  if (req->info || resent != pending_.end())
+    return;
+
+  auto& pin = pins_[key];
+  pin.worker = target;
+  pin.outstanding++;
+  members_[target].outstanding++;
+  pending_.emplace(req->id, pending_t{target, key, clock_t::now()});
+}
+//----------------------------------
+void broker::from_worker()
+{
+  std::string identity;
+  buffers_t   frames;
+  if (!recv(workers_, identity, frames))
+    return;
+
+  if (worker::is_control(frames))
+  {
+    const auto verb = worker::verb(frames);
+    if (verb == worker::g_ready)
+      join(identity);
+    else
+    if (verb == worker::g_heartbeat)
+    {
+      if (auto it = members_.find(identity); it != members_.end())
+        it->second.seen = clock_t::now();
+      else
+        join(identity);
+    }
+    else
+    if (verb == worker::g_leave)
+      drop(identity);
+    return;
+  }
+
+  if (auto it = members_.find(identity); it != members_.end())
+    it->second.seen = clock_t::now();
+
+  if (!batch::is_batch(frames))
+  {
+    if (on_reply(identity, frames))
+      reply(std::move(frames));
+    return;
+  }
+
+  auto       messages = batch::split(buffers_t{frames});
+  const auto size     = messages.size();
+  std::erase_if(messages, [this, &identity](const auto& message) { return !on_reply(identity, message); });
+  if (messages.size() == size)
+    reply(std::move(frames));
+  else
+  if (!messages.empty())
+    reply(batch::join(std::move(messages)));
+}
+//----------------------------------
+// Returns false for a reply to a request the broker already failed on the worker's
+// behalf (kiq has its answer, and may have resent it elsewhere), and for the worker's
+// busy and credit infos, which are folded into the broker's own.
+bool broker::on_reply(const std::string& worker, const buffers_t& frames)
+{
+  const auto  msg = DeserializeIPCMessage(buffers_t{frames});
+  std::string id;
+  if (!msg)
+  {
+    kiq::log::klog().w("Dropping unreadable reply from {}", worker);
+    return false;
+  }
+
+  if (msg->type() == constants::IPC_PLATFORM_INFO)
+  {
+    const auto type = static_cast<platform_info*>(msg.get())->type();
+    if (type != g_busy && type != g_credit)
+      return true;
+
+    if (auto it = members_.find(worker); it != members_.end())
+      it->second.busy = type == g_busy;
+    return false;                                                     // pace() speaks for all workers
+  }
+
+  if (msg->type() == constants::IPC_OK_TYPE)
+    id = static_cast<const okay_message*>(msg.get())->id();
+  else
+  if (msg->type() == constants::IPC_FAIL_TYPE)
+    id = static_cast<const fail_message*>(msg.get())->id();
+  else
+    return true;
+
+  if (const auto it = failed_.find(id); it != failed_.end() && it->second.worker == worker)
+  {
+    kiq::log::klog().d("Dropping reply from {} to request {}, already failed", worker, id);
+    return false;
+  }
+
+  if (const auto it = pending_.find(id); it != pending_.end() && it->second.worker == worker)
+    complete(id);
+  return true;
+}
+//----------------------------------
+void broker::join(const std::string& id)
+{
+  members_[id].seen = clock_t::now();
+  if (ring_.contains(id))
+    return;
+
+  ring_.add(id);
+  kiq::log::klog().i("Worker {} joined. {} workers", id, ring_.size());
+}
+//----------------------------------
+// Outstanding requests, including those held in its backlog, are failed rather than
+// moved: the worker may have sent some of them already, and kiq decides whether to resend.
+void broker::drop(const std::string& id)
+{
+  ring_.remove(id);
+  if (!members_.erase(id))
+    return;
+
+  std::vector<std::string> orphans;
+  for (const auto& [request, entry] : pending_)
+    if (entry.worker == id)
+      orphans.push_back(request);
+
+  for (const auto& request : orphans)
+    fail(request);
+
+  kiq::log::klog().w("Worker {} left with {} requests outstanding. {} workers", id, orphans.size(), ring_.size());
+}
+//----------------------------------
+void broker::complete(const std::string& id)
+{
+  const auto it = pending_.find(id);
+  if (it == pending_.end())
+    return;
+
+  if (auto member = members_.find(it->second.worker); member != members_.end() && member->second.outstanding)
+    member->second.outstanding--;
+
+  if (auto pin = pins_.find(it->second.room); pin != pins_.end() && !--pin->second.outstanding)
+    pins_.erase(pin);
+
+  pending_.erase(it);
+}
+//----------------------------------
+void broker::fail(const std::string& id)
+{
+  if (const auto it = pending_.find(id); it != pending_.end())
+    failed_.insert_or_assign(id, failed_t{it->second.worker, clock_t::now()});
+
+  reply(fail_message(g_platform, id).data());
+  complete(id);
+}
+//----------------------------------
+// Replies to kiq keep their order; while kiq is not reading they wait in outbox_
+void broker::reply(buffers_t&& frames)
+{
+  if (!outbox_.empty())
+    return outbox_.push_back(std::move(frames));
+
+  if (const auto sent = send(tx_, frames); sent == sent_t::full)
+    outbox_.push_back(std::move(frames));
+  else
+  if (sent == sent_t::gone)
+    kiq::log::klog().e("Failed to send reply to kiq");
+}
+//----------------------------------
+// Sends what was held back for kiq and for full workers, in order, until each is full
+// again
+void broker::flush()
+{
+  while (!outbox_.empty())
+  {
+    if (const auto sent = send(tx_, outbox_.front()); sent == sent_t::full)
+      break;
+    else
+    if (sent == sent_t::gone)
+      kiq::log::klog().e("Failed to send reply to kiq");
+    outbox_.pop_front();
+  }
+
+  std::vector<std::string> gone;
+  for (auto& [id, member] : members_)
+    while (!member.backlog.empty())
+    {
+      const auto sent = send(workers_, member.backlog.front(), &id);
+      if (sent == sent_t::full)
+        break;
+
+      if (sent == sent_t::gone)
+      {
+        gone.push_back(id);
+        break;
+      }
+      member.backlog.pop_front();
+    }
+
+  for (const auto& id : gone)
+    drop(id);
+}
+//----------------------------------
+// kiq sees one window across all workers, like that of a single daemon: busy once the
+// posts outstanding reach the sum of the workers' max_pending or every worker says it is
+// busy, and credit again once half of it is free and some worker is not busy
+void broker::pace()
+{
+  if (members_.empty())
+    return;
+
+  const size_t capacity = members_.size() * front_.max_pending;
+  const size_t depth    = pending_.size();
+  const bool   full     = depth >= capacity ||
+                          std::all_of(members_.begin(), members_.end(), [](const auto& member) { return member.second.busy; });
+  if (!busy_ && full)
+  {
+    busy_ = true;
+    reply(make_credit(g_busy, 0, depth));
+  }
+  else
+  if (busy_ && !full && depth <= capacity / 2)
+  {
+    busy_ = false;
+    reply(make_credit(g_credit, capacity - depth, depth));
+  }
+}
+//----------------------------------
+// Workers time out their own requests after request_ttl; anything held past that and
+// the heartbeat timeout lost its reply, and is only forgotten here.
+void broker::expire()
+{
+  const auto now = clock_t::now();
+
+  std::vector<std::string> silent;
+  for (const auto& [id, member] : members_)
+    if (now - member.seen > options_.timeout)
+      silent.push_back(id);
+
+  for (const auto& id : silent)
+  {
+    kiq::log::klog().w("Worker {} timed out", id);
+    drop(id);
+  }
+
+  std::vector<std::string> stale;
+  for (const auto& [id, entry] : pending_)
+    if (now - entry.sent > front_.request_ttl + options_.timeout)
+      stale.push_back(id);
+
+  for (const auto& id : stale)
+    complete(id);
+
+  std::erase_if(failed_, [this, now](const auto& item) { return now - item.second.at > front_.request_ttl + options_.timeout; });
+}
+} // ns kiq::katrix
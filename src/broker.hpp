@@ -0,0 +1,108 @@
+#pragma once
+
+#include <deque>
+#include <unordered_map>
+#include "hash_ring.hpp"
+#include "server.hpp"
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+struct broker_options
+{
+  std::string               workers_addr{"tcp://0.0.0.0:28479"};
+  std::chrono::milliseconds timeout     {3000}; // Workers silent this long are dropped
+  size_t                    replicas    {64};   // Points per worker on the hash ring
+  size_t                    backlog     {1000}; // Requests held per worker while it is full
+};
+//-------------------------------------------------------------
+// Front for several katrix workers. To kiq it looks like one daemon, on the same ports;
+// workers connect to workers_addr and register themselves (see worker.hpp).
+//
+// Each request goes to the worker owning its room on a consistent hash ring, so adding
+// or removing a worker moves only that worker's share of rooms. A room with requests
+// still outstanding stays pinned to its worker until they are answered, even if the ring
+// has since changed, so posts to one room are never in flight on two workers at once.
+// Posts must name their room by id, or by none for the default room; posts naming an
+// alias are failed, since the broker cannot tell which room it stands for.
+// Replies are passed back to kiq unchanged, except the workers' busy and credit infos:
+// the broker sends its own instead, for the total outstanding against the workers'
+// combined max_pending. When a worker leaves or times out, its
+// outstanding requests are failed so kiq can resend them, and any replies it still sends
+// for them are dropped. A worker at its high-water mark is not dropped: its requests are
+// held, up to backlog of them, and sent in order as it drains. Replies to kiq are
+// likewise queued while kiq is not reading, so no send blocks the broker's loop.
+//-------------------------------------------------------------
+class broker
+{
+using clock_t   = std::chrono::steady_clock;
+using buffers_t = std::vector<ipc_message::byte_buffer>;
+enum class sent_t
+{
+  ok,
+  full,                                         // At its high-water mark: try again later
+  gone                                          // No such peer
+};
+struct worker_t
+{
+  clock_t::time_point   seen;
+  size_t                outstanding{0};
+  bool                  busy{false};            // As its last busy or credit info said
+  std::deque<buffers_t> backlog;
+};
+struct pending_t
+{
+  std::string         worker;
+  std::string         room;
+  clock_t::time_point sent;
+};
+struct pin_t
+{
+  std::string worker;
+  size_t      outstanding{0};
+};
+struct failed_t
+{
+  std::string         worker;
+  clock_t::time_point at;
+};
+//------------------------------------
+public:
+  broker(const server_options& front, const broker_options& options = {});
+
+  void run ();
+  void stop();
+
+private:
+  void   from_kiq   ();
+  void   from_worker();
+  void   dispatch   (buffers_t&& frames);
+  bool   on_reply   (const std::string& worker, const buffers_t& frames);
+  void   join       (const std::string& id);
+  void   drop       (const std::string& id);
+  void   complete   (const std::string& id);
+  void   fail       (const std::string& id);
+  void   reply      (buffers_t&& frames);
+  void   flush      ();
+  void   pace       ();
+  void   expire     ();
+  bool   recv       (zmq::socket_t& socket, std::string& identity, buffers_t& frames);
+  sent_t send       (zmq::socket_t& socket, const buffers_t& frames, const std::string* identity = nullptr);
+
+  server_options                             front_;
+  broker_options                             options_;
+  zmq::context_t                             context_;
+  zmq::socket_t                              rx_;       // Requests from kiq
+  zmq::socket_t                              tx_;       // Replies to kiq
+  zmq::socket_t                              workers_;
+  std::atomic<bool>                          active_{true};
+  hash_ring                                  ring_;
+  request_converter                          converter_;
+  std::unordered_map<std::string, worker_t>  members_;
+  std::unordered_map<std::string, pending_t> pending_;
+  std::unordered_map<std::string, pin_t>     pins_;
+  std::unordered_map<std::string, failed_t>  failed_;   // Failed here while their worker may still reply
+  std::deque<buffers_t>                      outbox_;   // Replies waiting for kiq to read
+  bool                                       busy_{true}; // Until the first worker gives credit
+};
+} // ns kiq::katrix
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <logger.hpp>
+
+namespace kiq::katrix {
+//----------------------------------------------------------------------------------------------
+class bucket
+{
+using clock_t = std::chrono::steady_clock;
+public:
+using duration_t = clock_t::duration;
+static constexpr auto g_max  = clock_t::duration{std::chrono::minutes(1)};
+static constexpr auto g_rate = clock_t::duration{std::chrono::minutes(1)} / 4;
+//------------------------------------
+  bucket(duration_t rate = g_rate, duration_t max = g_max)
+  : available_(max),
+    rate_     (rate),
+    max_      (max)
+  {}
+//------------------------------------
+  bool request(int quantity)
+  {
+    refill();
+
+    const auto required = (quantity * (rate_));
+    const auto result   = required <= available_;
+
+    if (result)
+      available_ -= required;
+
+    kiq::log::klog().d("Bucket request result: {}", result);
+    return result;
+  }
+
+  bool has_token() const
+  {
+    const auto result = (available_ + (clock_t::now() - last_refill_) >= rate_);
+    kiq::log::klog().d("Bucket has tokens: {}", result);
+    return result;
+  }
+
+  duration_t wait_time(int quantity = 1)
+  {
+    refill();
+
+    const auto required = (quantity * (rate_));
+    return (required > available_) ? required - available_ : duration_t::zero();
+  }
+
+  bool full() const
+  {
+    return available_ + (clock_t::now() - last_refill_) >= max_;
+  }
+
+  void set_rate(duration_t rate, duration_t max)
+  {
+    refill();
+    rate_      = rate;
+    max_       = max;
+    available_ = std::min(available_, max_);
+  }
+
+  duration_t rate() const { return rate_; }
+//------------------------------------
+private:
+  void refill()
+  {
+    const auto now  = clock_t::now();
+    available_     += now - last_refill_;
+    available_      = std::min(available_, max_);
+    last_refill_    = now;
+  }
+//------------------------------------
+  clock_t::duration   available_;
+  clock_t::duration   rate_;
+  clock_t::duration   max_;
+  clock_t::time_point last_refill_{clock_t::now()};
+};
+} // ns kiq::katrix
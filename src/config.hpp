@@ -0,0 +1,165 @@
+#pragma once
+
+#include "alias_cache.hpp"
+#include "broker.hpp"
+#include "scheduler.hpp"
+#include "filter.hpp"
+#include "server.hpp"
+#include "session.hpp"
+#include "upload.hpp"
+#include <logger.hpp>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// An additional account for a bot_pool. Its session defaults to "<session>.<user>".
+//-------------------------------------------------------------
+struct account_options
+{
+  std::string user;
+  std::string pass;
+  std::string session;
+};
+//-------------------------------------------------------------
+// Deployment settings, read from a JSON file. Missing keys keep their defaults.
+//-------------------------------------------------------------
+struct config
+{
+  using accounts_t = std::vector<account_options>;
+
+  std::string       server;
+  uint16_t          port{443};
+  bool              verify_tls{true};
+  std::string       user;
+  std::string       pass;
+  std::string       room;
+  std::string       session{"katrix.session"};
+  std::string       media_cache{"katrix.media"};
+  size_t            media_capacity{10000};
+  std::string       scheduled{"katrix.scheduled"};
+  size_t            max_sends{8};
+  scheduler_options scheduling;
+  std::string       metrics_file;
+  server_options    ipc;
+  upload_options    upload;
+  filter_options    sync;
+  alias_options     aliases;
+  accounts_t        accounts;
+  std::string       routing{"affinity"}; // "affinity" or "least_loaded"
+  std::string       mode;                // "broker" to front several worker processes
+  broker_options    broker;
+//------------------------------------
+  static config load(const std::string& path)
+  {
+    config cfg;
+    const auto json = read_json(path);
+    if (!json.is_object())
+    {
+      kiq::log::klog().w("No usable config at {}. Using defaults", path);
+      return cfg;
+    }
+
+    cfg.server  = json.value("server",  cfg.server);
+    cfg.port    = json.value("port",    cfg.port);
+    cfg.user    = json.value("user",    cfg.user);
+    cfg.pass    = json.value("pass",    cfg.pass);
+    cfg.room    = json.value("room",    cfg.room);
+    cfg.session = json.value("session", cfg.session);
+
+    cfg.media_cache    = json.value("media_cache",    cfg.media_cache);
+    cfg.media_capacity = json.value("media_capacity", cfg.media_capacity);
+    cfg.scheduled      = json.value("scheduled",      cfg.scheduled);
+    cfg.max_sends      = json.value("max_sends",      cfg.max_sends);
+    cfg.metrics_file   = json.value("metrics_file",   cfg.metrics_file);
+    cfg.routing        = json.value("routing",        cfg.routing);
+    cfg.mode           = json.value("mode",           cfg.mode);
+
+    if (const auto accounts = json.value("accounts", nlohmann::json::array()); accounts.is_array())
+      for (const auto& account : accounts)
+        if (account.is_object())
+          cfg.accounts.push_back(account_options{account.value("user", ""), account.value("pass", ""), account.value("session", "")});
+
+    const auto seconds = [](auto d) { return std::chrono::duration_cast<std::chrono::seconds>(d).count(); };
+    cfg.scheduling.room_rate  = std::chrono::seconds(json.value("room_rate",  seconds(cfg.scheduling.room_rate)));
+    cfg.scheduling.room_burst = std::chrono::seconds(json.value("room_burst", seconds(cfg.scheduling.room_burst)));
+    cfg.scheduling.room_burst = std::max(cfg.scheduling.room_burst, cfg.scheduling.room_rate);
+    if (const auto weights = json.value("room_weights", nlohmann::json::object()); weights.is_object())
+      for (const auto& [room, weight] : weights.items())
+        if (weight.is_number_unsigned())
+          cfg.scheduling.weights[room] = weight.get<uint32_t>();
+
+    cfg.aliases.path         = json.value("alias_cache", cfg.aliases.path);
+    cfg.aliases.ttl          = std::chrono::seconds(json.value("alias_ttl",          cfg.aliases.ttl.count()));
+    cfg.aliases.negative_ttl = std::chrono::seconds(json.value("alias_negative_ttl", cfg.aliases.negative_ttl.count()));
+
+    if (const auto ipc = json.value("ipc", nlohmann::json::object()); ipc.is_object())
+    {
+      cfg.ipc.rx_addr         = ipc.value("rx_addr", cfg.ipc.rx_addr);
+      cfg.ipc.tx_addr         = ipc.value("tx_addr", cfg.ipc.tx_addr);
+      cfg.ipc.dedupe_capacity = ipc.value("dedupe_capacity", cfg.ipc.dedupe_capacity);
+      cfg.ipc.dedupe_window   = std::chrono::seconds(ipc.value("dedupe_window", cfg.ipc.dedupe_window.count()));
+      cfg.ipc.request_ttl     = std::chrono::seconds(ipc.value("request_ttl",   cfg.ipc.request_ttl.count()));
+      cfg.ipc.max_pending     = std::max(ipc.value("max_pending", cfg.ipc.max_pending), size_t{2});
+      cfg.ipc.rx_hwm          = ipc.value("rx_hwm", cfg.ipc.rx_hwm);
+      cfg.ipc.tx_hwm          = ipc.value("tx_hwm", cfg.ipc.tx_hwm);
+      cfg.ipc.batch_replies   = ipc.value("batch_replies", cfg.ipc.batch_replies);
+      cfg.ipc.reply_batch     = std::max(ipc.value("reply_batch", cfg.ipc.reply_batch), size_t{1});
+      cfg.ipc.reply_window    = std::chrono::milliseconds(ipc.value("reply_window", cfg.ipc.reply_window.count()));
+      cfg.ipc.broker_addr     = ipc.value("broker_addr", cfg.ipc.broker_addr);
+      cfg.ipc.worker_id       = ipc.value("worker_id",   cfg.ipc.worker_id);
+      cfg.ipc.heartbeat       = std::chrono::milliseconds(ipc.value("heartbeat", cfg.ipc.heartbeat.count()));
+    }
+
+    if (const auto broker = json.value("broker", nlohmann::json::object()); broker.is_object())
+    {
+      cfg.broker.workers_addr = broker.value("workers_addr", cfg.broker.workers_addr);
+      cfg.broker.timeout      = std::chrono::milliseconds(broker.value("timeout", cfg.broker.timeout.count()));
+      cfg.broker.replicas     = broker.value("replicas", cfg.broker.replicas);
+      cfg.broker.backlog      = broker.value("backlog",  cfg.broker.backlog);
+    }
+
+    if (const auto upload = json.value("upload", nlohmann::json::object()); upload.is_object())
+    {
+      cfg.upload.stream_threshold = upload.value("stream_threshold", cfg.upload.stream_threshold);
+      cfg.upload.chunk_size       = upload.value("chunk_size",       cfg.upload.chunk_size);
+      cfg.upload.max_inflight     = upload.value("max_inflight",     cfg.upload.max_inflight);
+      cfg.upload.workers          = upload.value("workers",          cfg.upload.workers);
+      cfg.upload.connect_timeout  = std::chrono::seconds(upload.value("connect_timeout", cfg.upload.connect_timeout.count()));
+      cfg.upload.low_speed_limit  = upload.value("low_speed_limit",  cfg.upload.low_speed_limit);
+      cfg.upload.low_speed_time   = std::chrono::seconds(upload.value("low_speed_time",  cfg.upload.low_speed_time.count()));
+    }
+    cfg.verify_tls        = json.value("verify_tls", cfg.verify_tls);
+    cfg.upload.verify_tls = cfg.verify_tls;
+
+    if (const auto sync = json.value("sync", nlohmann::json::object()); sync.is_object())
+    {
+      cfg.sync.enabled        = sync.value("filter",         cfg.sync.enabled);
+      cfg.sync.lazy_members   = sync.value("lazy_members",   cfg.sync.lazy_members);
+      cfg.sync.timeline_limit = sync.value("timeline_limit", cfg.sync.timeline_limit);
+      cfg.sync.event_types    = sync.value("event_types",    cfg.sync.event_types);
+      cfg.sync.state_types    = sync.value("state_types",    cfg.sync.state_types);
+      cfg.sync.rooms          = sync.value("rooms",          cfg.sync.rooms);
+    }
+
+    return cfg;
+  }
+//------------------------------------
+  // Settings for an additional account: the same server and options, with its own
+  // credentials and its own files, suffixed with the user name
+  config for_account(const account_options& account) const
+  {
+    auto suffix = [&account](const std::string& path) { return path.empty() ? path : path + '.' + account.user; };
+
+    config cfg{*this};
+    cfg.user         = account.user;
+    cfg.pass         = account.pass;
+    cfg.session      = account.session.empty() ? suffix(session) : account.session;
+    cfg.media_cache  = suffix(media_cache);
+    cfg.scheduled    = suffix(scheduled);
+    cfg.aliases.path = suffix(aliases.path);
+    cfg.metrics_file.clear();
+    cfg.accounts    .clear();
+    return cfg;
+  }
+};
+} // ns kiq::katrix
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Remembers the most recent `capacity` ids, or those seen within `window`, whichever
+// is smaller. Ids live in a fixed ring; the hash index only holds views into it.
+//-------------------------------------------------------------
+class dedupe_index
+{
+using clock_t    = std::chrono::steady_clock;
+using duration_t = clock_t::duration;
+struct entry
+{
+  std::string         id;
+  clock_t::time_point time;
+};
+//------------------------------------
+public:
+  explicit dedupe_index(size_t capacity, duration_t window = duration_t::max())
+  : ring_  (capacity ? capacity : 1),
+    window_(window)
+  {
+    index_.reserve(ring_.size());
+  }
+//------------------------------------
+  // Returns false if the id was already seen
+  bool insert(std::string_view id)
+  {
+    const auto now = clock_t::now();
+    expire(now);
+
+    if (index_.contains(id))
+      return false;
+
+    if (count_ == ring_.size())
+      pop();
+
+    entry& e = ring_[(head_ + count_) % ring_.size()];
+    e.id.assign(id);
+    e.time = now;
+    index_.insert(e.id);
+    count_++;
+    return true;
+  }
+//------------------------------------
+  bool   contains(std::string_view id) const { return index_.contains(id); }
+  size_t size    ()                    const { return count_;              }
+  size_t capacity()                    const { return ring_.size();        }
+//------------------------------------
+private:
+  void expire(clock_t::time_point now)
+  {
+    while (count_ && now - ring_[head_].time > window_)
+      pop();
+  }
+//------------------------------------
+  void pop()
+  {
+    index_.erase(ring_[head_].id);
+    head_ = (head_ + 1) % ring_.size();
+    count_--;
+  }
+//------------------------------------
+  std::vector<entry>                   ring_;
+  std::unordered_set<std::string_view> index_;
+  duration_t                           window_;
+  size_t                               head_ {0};
+  size_t                               count_{0};
+};
+} // ns kiq::katrix
@@ -0,0 +1,283 @@
+#include "delivery.hpp"
+#include "session.hpp"
+#include <algorithm>
+#include <charconv>
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+#include <logger.hpp>
+#include <nlohmann/json.hpp>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+static std::string to_line(const request_t& req, int64_t due)
+{
+  return nlohmann::json{
+    {"id",       req.id},
+    {"due",      due},
+    {"user",     req.user},
+    {"room",     req.room},
+    {"text",     req.text},
+    {"media",    req.media},
+    {"priority", static_cast<int>(req.priority)}}.dump() + '\n';
+}
+//----------------------------------
+// request_t is move-only; a compaction snapshot copies the fields the journal keeps
+static request_t journalled(const request_t& req)
+{
+  request_t copy;
+  copy.id       = req.id;
+  copy.user     = req.user;
+  copy.room     = req.room;
+  copy.text     = req.text;
+  copy.media    = req.media;
+  copy.priority = req.priority;
+  return copy;
+}
+//----------------------------------
+static bool write_all(int fd, const std::string& data)
+{
+  for (size_t done = 0; done < data.size();)
+  {
+    const auto n = ::write(fd, data.data() + done, data.size() - done);
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+//-------------------------------------------------------------
+delivery_queue::delivery_queue(const std::string& path)
+: path_ (path),
+  wheel_(g_resolution)
+{
+  load();
+}
+//----------------------------------
+delivery_queue::~delivery_queue()
+{
+  flush();
+  close();
+}
+//----------------------------------
+void delivery_queue::add(request_t req, int64_t due)
+{
+  write(to_line(req, due));
+
+  auto id = req.id;
+  arm(id, due);
+  if (const auto it = entries_.find(id); it != entries_.end())
+  {
+    dues_.erase(dues_.find(it->second.due));
+    dead_++;
+  }
+  dues_.insert(due);
+  entries_.insert_or_assign(std::move(id), entry{std::move(req), due});
+}
+//----------------------------------
+void delivery_queue::flush()
+{
+  if (fd_ < 0 || buffer_.empty())
+    return;
+
+  if (!write_all(fd_, buffer_))
+    kiq::log::klog().e("Failed to write scheduled posts to {}", path_);
+  buffer_.clear();
+}
+//----------------------------------
+// Returns false if the journal could not be made durable; without one, there is nothing to do
+bool delivery_queue::sync()
+{
+  if (fd_ < 0)
+    return path_.empty();
+
+  const bool written = buffer_.empty() || write_all(fd_, buffer_);
+  buffer_.clear();
+  if (written && ::fdatasync(fd_) == 0)
+    return true;
+
+  kiq::log::klog().e("Failed to sync scheduled posts to {}", path_);
+  return false;
+}
+//----------------------------------
+size_t delivery_queue::size() const
+{
+  return entries_.size();
+}
+//----------------------------------
+bool delivery_queue::empty() const
+{
+  return entries_.empty();
+}
+//----------------------------------
+int64_t delivery_queue::next_due() const
+{
+  return dues_.empty() ? 0 : *dues_.begin();
+}
+//----------------------------------
+bool delivery_queue::compaction_due() const
+{
+  return !path_.empty() && !compacting_ && dead_ > entries_.size() + 1024;
+}
+//----------------------------------
+// The returned job owns a copy of the live entries and touches nothing else
+delivery_queue::compaction_t delivery_queue::begin_compaction()
+{
+  auto entries = std::make_shared<std::vector<entry>>();
+  entries->reserve(entries_.size());
+  for (const auto& [id, e] : entries_)
+    entries->push_back(entry{journalled(e.req), e.due});
+
+  compacting_ = true;
+  dead_       = 0;
+  tail_.clear();
+  return [entries, path = path_ + ".compact"]
+  {
+    std::string data;
+    data.reserve(entries->size() * 256);
+    for (const auto& e : *entries)
+      data += to_line(e.req, e.due);
+    return write_file(path, data, true);
+  };
+}
+//----------------------------------
+void delivery_queue::finish_compaction(bool written)
+{
+  const auto side = path_ + ".compact";
+  compacting_     = false;
+  if (written)
+  {
+    flush();                                         // tail_ holds these lines too
+    const int fd = ::open(side.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    written = fd >= 0 && write_all(fd, tail_) && ::fdatasync(fd) == 0;
+    if (fd >= 0)
+      written = (::close(fd) == 0) && written;
+
+    if (written)
+    {
+      close();
+      written = std::rename(side.c_str(), path_.c_str()) == 0;
+      open();
+    }
+  }
+  tail_.clear();
+
+  if (!written)
+    kiq::log::klog().w("Failed to compact scheduled posts in {}", path_);
+}
+//----------------------------------
+// Unix time in seconds, or milliseconds if the value is too large to be seconds. Returns
+// 0 for anything unparseable.
+int64_t delivery_queue::parse_time(const std::string& time)
+{
+  static const int64_t g_ms_threshold{100000000000};
+  int64_t              value{0};
+  const auto           res = std::from_chars(time.data(), time.data() + time.size(), value);
+  if (res.ec != std::errc{} || value <= 0)
+    return 0;
+
+  return (value >= g_ms_threshold) ? value / 1000 : value;
+}
+//----------------------------------
+int64_t delivery_queue::now()
+{
+  return std::chrono::duration_cast<std::chrono::seconds>(wall_t::now().time_since_epoch()).count();
+}
+//----------------------------------
+void delivery_queue::arm(const std::string& id, int64_t due)
+{
+  const auto delay = std::chrono::seconds(std::max(due - now(), int64_t{0}));
+  wheel_.add(clock_t::now() + delay, id);
+}
+//----------------------------------
+void delivery_queue::remove(const std::string& id)
+{
+  write(nlohmann::json{{"done", id}}.dump() + '\n');
+  dead_ += 2;
+}
+//----------------------------------
+void delivery_queue::write(const std::string& line)
+{
+  if (fd_ < 0)
+    return;
+
+  buffer_ += line;
+  if (compacting_)
+    tail_ += line;
+}
+//----------------------------------
+void delivery_queue::open()
+{
+  fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd_ < 0)
+    kiq::log::klog().e("Failed to open scheduled posts journal {}", path_);
+}
+//----------------------------------
+void delivery_queue::close()
+{
+  if (fd_ >= 0)
+    ::close(fd_);
+  fd_ = -1;
+}
+//----------------------------------
+// {"id", "due", ...} adds a request; {"done": id} removes it
+void delivery_queue::load()
+{
+  if (path_.empty())
+    return;
+
+  std::ifstream file{path_};
+  std::string   line;
+  while (file && std::getline(file, line))
+  {
+    const auto json = nlohmann::json::parse(line, nullptr, false);
+    if (!json.is_object())
+      continue;
+
+    if (json.contains("done"))
+    {
+      entries_.erase(json.value("done", ""));
+      continue;
+    }
+
+    request_t req;
+    req.id       = json.value("id",    "");
+    req.user     = json.value("user",  "");
+    req.room     = json.value("room",  "");
+    req.text     = json.value("text",  "");
+    req.media    = json.value("media", "");
+    req.priority = static_cast<priority_t>(json.value("priority", static_cast<int>(priority_t::normal)));
+    const auto due = json.value("due", int64_t{0});
+    if (auto id = req.id; !id.empty())
+      entries_.insert_or_assign(std::move(id), entry{std::move(req), due});
+  }
+
+  for (const auto& [id, e] : entries_)
+  {
+    arm(id, e.due);
+    dues_.insert(e.due);
+  }
+
+  compact();
+  kiq::log::klog().i("Loaded {} scheduled posts from {}", entries_.size(), path_);
+}
+//----------------------------------
+void delivery_queue::compact()
+{
+  if (path_.empty())
+    return;
+
+  std::string data;
+  data.reserve(entries_.size() * 256);
+  for (const auto& [id, e] : entries_)
+    data += to_line(e.req, e.due);
+
+  close();
+  if (!write_file(path_, data, true))
+    kiq::log::klog().w("Failed to compact scheduled posts in {}", path_);
+
+  open();
+  dead_ = 0;
+}
+} // ns kiq::katrix
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "server.hpp"
+#include "timing_wheel.hpp"
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Requests to be sent at a future time. Each is armed on a timing wheel at one second
+// resolution and written to an append-only journal, which is replayed and compacted on
+// start so scheduled posts survive a restart. Lines are buffered until flush(); sync()
+// also waits for them to reach the disk, so a post acknowledged after it survives a host
+// crash, not only a process crash.
+//
+// Later compactions run in two steps so the file I/O can happen on another thread: the
+// job from begin_compaction() writes live entries to a side file, and
+// finish_compaction() appends whatever was journalled meanwhile and renames it over the
+// journal. Until then the old journal stays complete.
+//-------------------------------------------------------------
+class delivery_queue
+{
+using clock_t    = std::chrono::steady_clock;
+using wall_t     = std::chrono::system_clock;
+static constexpr auto g_resolution = std::chrono::seconds(1);
+
+struct entry
+{
+  request_t req;
+  int64_t   due;
+};
+//------------------------------------
+public:
+  explicit delivery_queue(const std::string& path = "");
+  ~delivery_queue();
+  delivery_queue(const delivery_queue&)            = delete;
+  delivery_queue& operator=(const delivery_queue&) = delete;
+
+  using compaction_t = std::function<bool()>;
+
+  void         add              (request_t req, int64_t due);
+  void         flush            ();
+  bool         sync             ();
+  size_t       size             () const;
+  bool         empty            () const;
+  int64_t      next_due         () const;     // Earliest due time, or 0 if empty
+  bool         compaction_due   () const;
+  compaction_t begin_compaction ();
+  void         finish_compaction(bool written);
+
+  // Invokes fn(request_t&&) for every request now due
+  template <typename F>
+  void advance(F&& fn)
+  {
+    wheel_.advance(clock_t::now(), [this, &fn](std::string&& id)
+    {
+      auto it = entries_.find(id);
+      if (it == entries_.end())
+        return;
+      if (it->second.due > now())   // Replaced with a later time, or woken early by rounding
+        return arm(id, it->second.due);
+
+      request_t req = std::move(it->second.req);
+      dues_.erase(dues_.find(it->second.due));
+      entries_.erase(it);
+      remove(req.id);
+      fn(std::move(req));
+    });
+    flush();
+  }
+
+  static int64_t parse_time(const std::string& time);
+  static int64_t now();
+
+private:
+  void arm    (const std::string& id, int64_t due);
+  void remove (const std::string& id);
+  void write  (const std::string& line);
+  void open   ();
+  void close  ();
+  void load   ();
+  void compact();
+
+  std::string                            path_;
+  int                                    fd_{-1};
+  std::string                            buffer_;     // Journalled, not yet written
+  timing_wheel<std::string>              wheel_;
+  std::unordered_map<std::string, entry> entries_;
+  std::multiset<int64_t>                 dues_;
+  size_t                                 dead_{0};
+  bool                                   compacting_{false};
+  std::string                            tail_;       // Journalled since the compaction began
+};
+} // ns kiq::katrix
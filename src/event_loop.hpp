@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Single-threaded epoll loop. File descriptors and timers are serviced on the thread
+// calling run(); post() is the only member safe to call from other threads.
+//-------------------------------------------------------------
+class event_loop
+{
+public:
+using clock_t = std::chrono::steady_clock;
+using task_t  = std::function<void()>;
+//------------------------------------
+  event_loop()
+  : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+    wake_fd_ (eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    timer_fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+  {
+    watch(wake_fd_,  [this] { drain(wake_fd_);  run_posted(); });
+    watch(timer_fd_, [this] { drain(timer_fd_); run_timers(); });
+  }
+//------------------------------------
+  ~event_loop()
+  {
+    close(timer_fd_);
+    close(wake_fd_);
+    close(epoll_fd_);
+  }
+//------------------------------------
+  void watch(int fd, task_t on_readable)
+  {
+    epoll_event ev{};
+    ev.events  = EPOLLIN;
+    ev.data.fd = fd;
+    handlers_[fd] = std::move(on_readable);
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+  }
+//------------------------------------
+  void post(task_t task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      posted_.push_back(std::move(task));
+    }
+    signal();
+  }
+//------------------------------------
+  void schedule(clock_t::duration delay, task_t task)
+  {
+    timers_.emplace(clock_t::now() + delay, std::move(task));
+    arm();
+  }
+//------------------------------------
+  void run()
+  {
+    static const int g_max_events{16};
+    epoll_event events[g_max_events];
+
+    while (active_)
+    {
+      const int n = epoll_wait(epoll_fd_, events, g_max_events, -1);
+      for (int i = 0; i < n && active_; i++)
+        if (auto it = handlers_.find(events[i].data.fd); it != handlers_.end())
+          it->second();
+    }
+  }
+//------------------------------------
+  void stop()
+  {
+    active_ = false;
+    signal();
+  }
+//------------------------------------
+private:
+  void signal()
+  {
+    const uint64_t count{1};
+    if (write(wake_fd_, &count, sizeof(count)) < 0)
+      return;
+  }
+//------------------------------------
+  static void drain(int fd)
+  {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) > 0) ;
+  }
+//------------------------------------
+  void run_posted()
+  {
+    std::vector<task_t> tasks;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks.swap(posted_);
+    }
+    for (auto& task : tasks)
+      task();
+  }
+//------------------------------------
+  void run_timers()
+  {
+    const auto now = clock_t::now();
+    while (!timers_.empty() && timers_.begin()->first <= now)
+    {
+      auto task = std::move(timers_.begin()->second);
+      timers_.erase(timers_.begin());
+      task();
+    }
+    arm();
+  }
+//------------------------------------
+  void arm()
+  {
+    if (timers_.empty())
+      return;
+
+    const auto delay = std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(timers_.begin()->first - clock_t::now()),
+                                std::chrono::nanoseconds(1));
+    itimerspec spec{};
+    spec.it_value.tv_sec  = delay.count() / 1000000000;
+    spec.it_value.tv_nsec = delay.count() % 1000000000;
+    timerfd_settime(timer_fd_, 0, &spec, nullptr);
+  }
+//------------------------------------
+  int                                        epoll_fd_;
+  int                                        wake_fd_;
+  int                                        timer_fd_;
+  std::atomic<bool>                          active_{true};
+  std::unordered_map<int, task_t>            handlers_;
+  std::multimap<clock_t::time_point, task_t> timers_;
+  std::mutex                                 mutex_;
+  std::vector<task_t>                        posted_;
+};
+} // ns kiq::katrix
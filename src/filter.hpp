@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Sync filter settings. When enabled, the definition is uploaded once and its id kept in
+// the session, so /sync only returns what the bot reads: allowed timeline event types,
+// the room state it tracks, presence of the bot's own user only, and no ephemeral or
+// account data.
+//-------------------------------------------------------------
+struct filter_options
+{
+  bool                     enabled       {false};
+  bool                     lazy_members  {true};
+  size_t                   timeline_limit{20};
+  std::vector<std::string> event_types   {"m.room.message"};
+  std::vector<std::string> state_types   {"m.room.canonical_alias", "m.room.name", "m.room.member", "m.room.power_levels"};
+  std::vector<std::string> rooms;          // Empty allows every joined room
+//------------------------------------
+  nlohmann::json definition(const std::string& self = "") const
+  {
+    static const nlohmann::json g_none{{"not_types", {"*"}}};
+
+    // State changes during incremental sync arrive in the timeline, so the tracked state
+    // types are allowed there too, or renames and alias changes would never be seen
+    auto timeline_types = event_types;
+    for (const auto& type : state_types)
+      if (std::find(timeline_types.begin(), timeline_types.end(), type) == timeline_types.end())
+        timeline_types.push_back(type);
+
+    nlohmann::json room{
+      {"timeline",     {{"limit", timeline_limit}, {"types", std::move(timeline_types)}, {"lazy_load_members", lazy_members}}},
+      {"state",        {{"types", state_types}, {"lazy_load_members", lazy_members}}},
+      {"ephemeral",    g_none},
+      {"account_data", g_none}};
+    if (!rooms.empty())
+      room["rooms"] = rooms;
+
+    const auto presence = self.empty() ? g_none : nlohmann::json{{"types", {"m.presence"}}, {"senders", {self}}};
+
+    return nlohmann::json{
+      {"room",         std::move(room)},
+      {"presence",     presence},
+      {"account_data", g_none}};
+  }
+};
+} // ns kiq::katrix
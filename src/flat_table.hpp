@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Open-addressed hash table over 64-bit keys, stored inline in one array. Linear probing
+// with backward-shift deletion keeps lookups to a few adjacent slots without tombstones.
+// The all-ones key is reserved.
+//-------------------------------------------------------------
+template <typename V>
+class flat_table
+{
+public:
+using key_t = uint64_t;
+static constexpr key_t g_empty{UINT64_MAX};
+//------------------------------------
+private:
+struct slot
+{
+  key_t key{g_empty};
+  V     value{};
+};
+//------------------------------------
+public:
+  V* find(key_t key)
+  {
+    if (slots_.empty())
+      return nullptr;
+
+    for (size_t i = index(key);; i = next(i))
+      if (slots_[i].key == key)
+        return &slots_[i].value;
+      else
+      if (slots_[i].key == g_empty)
+        return nullptr;
+  }
+//------------------------------------
+  const V* find(key_t key) const
+  {
+    return const_cast<flat_table*>(this)->find(key);
+  }
+//------------------------------------
+  V& operator[](key_t key)
+  {
+    if ((size_ + 1) * 10 > slots_.size() * 7)
+      grow();
+
+    size_t i = index(key);
+    for (; slots_[i].key != g_empty; i = next(i))
+      if (slots_[i].key == key)
+        return slots_[i].value;
+
+    size_++;
+    slots_[i].key = key;
+    return slots_[i].value;
+  }
+//------------------------------------
+  bool erase(key_t key)
+  {
+    if (slots_.empty())
+      return false;
+
+    size_t i = index(key);
+    for (; slots_[i].key != key; i = next(i))
+      if (slots_[i].key == g_empty)
+        return false;
+
+    for (size_t j = next(i);; j = next(j))      // Shift later members of the run back
+    {
+      if (slots_[j].key == g_empty)
+        break;
+      const size_t home = index(slots_[j].key);
+      if (((j - home) & mask()) >= ((j - i) & mask()))
+      {
+        slots_[i] = std::move(slots_[j]);
+        i = j;
+      }
+    }
+
+    slots_[i] = slot{};
+    size_--;
+    return true;
+  }
+//------------------------------------
+  template <typename F>
+  void for_each(F&& fn) const
+  {
+    for (const auto& s : slots_)
+      if (s.key != g_empty)
+        fn(s.key, s.value);
+  }
+//------------------------------------
+  size_t size () const { return size_;                            }
+  bool   empty() const { return !size_;                           }
+  size_t bytes() const { return slots_.capacity() * sizeof(slot); }
+//------------------------------------
+private:
+  size_t mask ()         const { return slots_.size() - 1; }
+  size_t next (size_t i) const { return (i + 1) & mask();  }
+  size_t index(key_t key) const
+  {
+    key ^= key >> 33;                            // fmix64 finalizer
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return static_cast<size_t>(key) & mask();
+  }
+//------------------------------------
+  void grow()
+  {
+    std::vector<slot> old(slots_.empty() ? 16 : slots_.size() * 2);
+    old.swap(slots_);
+    size_ = 0;
+    for (auto& s : old)
+      if (s.key != g_empty)
+        (*this)[s.key] = std::move(s.value);
+  }
+//------------------------------------
+  std::vector<slot> slots_;
+  size_t            size_{0};
+};
+} // ns kiq::katrix
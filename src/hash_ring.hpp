@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Consistent hash ring over named nodes. Each node is placed at `replicas` points, so
+// adding or removing one moves only about 1/n of the keys. Points are kept sorted in a
+// flat vector; lookups are a binary search.
+//-------------------------------------------------------------
+class hash_ring
+{
+struct point
+{
+  uint64_t    hash;
+  std::string node;
+  bool operator<(const point& other) const { return hash < other.hash; }
+};
+//------------------------------------
+public:
+  explicit hash_ring(size_t replicas = 64)
+  : replicas_(replicas ? replicas : 1)
+  {}
+//------------------------------------
+  void add(const std::string& node)
+  {
+    if (contains(node))
+      return;
+
+    for (size_t i = 0; i < replicas_; i++)
+      points_.push_back(point{hash(node + '#' + std::to_string(i)), node});
+    std::sort(points_.begin(), points_.end());
+    nodes_++;
+  }
+//------------------------------------
+  void remove(const std::string& node)
+  {
+    const auto end = std::remove_if(points_.begin(), points_.end(), [&node](const point& p) { return p.node == node; });
+    if (end != points_.end())
+      nodes_--;
+    points_.erase(end, points_.end());
+  }
+//------------------------------------
+  // The node owning key, or an empty string if the ring is empty
+  const std::string& find(std::string_view key) const
+  {
+    static const std::string g_none;
+    if (points_.empty())
+      return g_none;
+
+    const auto it = std::lower_bound(points_.begin(), points_.end(), point{hash(key), {}});
+    return (it == points_.end()) ? points_.front().node : it->node;
+  }
+//------------------------------------
+  bool contains(const std::string& node) const
+  {
+    return std::any_of(points_.begin(), points_.end(), [&node](const point& p) { return p.node == node; });
+  }
+//------------------------------------
+  size_t size () const { return nodes_;        }
+  bool   empty() const { return !nodes_;       }
+//------------------------------------
+  // FNV-1a, then a final mix so nearby keys spread around the ring
+  static uint64_t hash(std::string_view key)
+  {
+    uint64_t h{14695981039346656037ULL};
+    for (const unsigned char c : key)
+    {
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+//------------------------------------
+private:
+  size_t             replicas_;
+  size_t             nodes_{0};
+  std::vector<point> points_;
+};
+} // ns kiq::katrix
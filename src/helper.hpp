@@ -10,9 +10,10 @@
 #include "mtx.hpp"
 #include "mtxclient/http/client.hpp"
 #include "mtxclient/http/errors.hpp"
+#include "bucket.hpp"
+#include "json_writer.hpp"
 
 namespace kiq::katrix {
-std::shared_ptr<mtx::http::Client> g_client = nullptr;
 using namespace mtx::client;
 using namespace mtx::http;
 using namespace mtx::events;
@@ -21,9 +22,9 @@ using PublicMessage = RoomEvent<msg::Text>;
 ///////////////////////////////////////////////////////////////
 using namespace kiq::log;
 ///////////////////////////////////////////////////////////////
-std::string get_sender(const mtx::events::collections::TimelineEvents &event)
+const std::string& get_sender(const mtx::events::collections::TimelineEvents &event)
 {
-  return std::visit([](auto e) { return e.sender; }, event);
+  return std::visit([](const auto& e) -> const std::string& { return e.sender; }, event);
 }
 ///////////////////////////////////////////////////////////////
 bool is_room_message(const mtx::events::collections::TimelineEvents &e)
@@ -69,7 +70,19 @@ void print_error(RequestErr e)
   klog().e("HTTP  code: {}\nError msg:  {}\nError code: {}", e->status_code, e->matrix_error.error, e->error_code);
 }
 ///////////////////////////////////////////////////////////////
-void login_handler(const mtx::responses::Login &res, RequestErr err)
+bool rate_limited(const RequestErr& e)
+{
+  return e && (e->status_code == 429 || e->matrix_error.errcode == mtx::errors::ErrorCode::M_LIMIT_EXCEEDED);
+}
+///////////////////////////////////////////////////////////////
+std::chrono::milliseconds retry_after(const RequestErr& e)
+{
+  static const auto g_default = std::chrono::milliseconds(5000);
+  const auto        retry     = std::chrono::duration_cast<std::chrono::milliseconds>(e->matrix_error.retry_after);
+  return (retry.count() > 0) ? retry : g_default;
+}
+///////////////////////////////////////////////////////////////
+void login_handler(mtx::http::Client& client, const mtx::responses::Login &res, RequestErr err)
 {
   if (err)
   {
@@ -78,59 +91,20 @@ void login_handler(const mtx::responses::Login &res, RequestErr err)
   }
   klog().i("{} logged in with device id {}", res.user_id.to_string(), res.device_id);
 
-  g_client->set_access_token(res.access_token);
+  client.set_access_token(res.access_token);
 }
-//----------------------------------------------------------------------------------------------
-class bucket
-{
-using clock_t = std::chrono::steady_clock;
-using duration_t = clock_t::duration;
-static constexpr auto g_max = clock_t::duration{std::chrono::minutes(1)};
-//------------------------------------
-public:
-  bool request(int quantity)
-  {
-    refill();
-
-    const auto required = (quantity * (rate_));
-    const auto result   = required <= available_;
-
-    if (result)
-      available_ -= required;
-
-    klog().d("Bucket request result: {}", result);
-    return result;
-  }
-
-  bool has_token() const
-  {
-    const auto result = (available_ >= rate_);
-    klog().d("Bucket has tokens: {}", result);
-    return result;
-  }
-//------------------------------------
-private:
-  void refill()
-  {
-    const auto now  = clock_t::now();
-    available_     += now - last_refill_;
-    available_      = std::min(available_, g_max);
-    last_refill_    = now;
-  }
-//------------------------------------
-  clock_t::duration   available_  {g_max};
-  clock_t::duration   rate_       {clock_t::duration(std::chrono::minutes(1)) / 4};
-  clock_t::time_point last_refill_{clock_t::now()};
-};
 //-------------------------------------
-static std::string to_json(const mtx::events::presence::Presence p, const std::string& name = "")
+static std::string to_json(const mtx::events::presence::Presence& p, const std::string& name = "")
 {
-  return std::string{
-      "{\"name\": \"" + name +
-    "\",\"avatar\":\"" + p.avatar_url +
-    "\",\"last\": \"" + std::to_string(p.last_active_ago) +
-    "\",\"active\": \"" + std::to_string(p.currently_active) +
-    "\",\"status\": \"" + p.status_msg +
-    "\",\"presence\": \"" + mtx::presence::to_string(p.presence) + "\"}"};
+  json_writer writer{256 + p.status_msg.size() + p.avatar_url.size()};
+  writer.begin_object()
+        .field("name",     name)
+        .field("avatar",   p.avatar_url)
+        .field("last",     std::to_string(p.last_active_ago))
+        .field("active",   std::to_string(p.currently_active))
+        .field("status",   p.status_msg)
+        .field("presence", mtx::presence::to_string(p.presence))
+        .end_object();
+  return writer.str();
 }
 } // ns kiq::katrix
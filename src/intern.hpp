@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Maps strings to dense 32-bit ids. Each distinct string is stored once, packed into
+// fixed-size blocks so views stay valid as the table grows. Strings are never removed.
+//-------------------------------------------------------------
+class interner
+{
+public:
+using id_t = uint32_t;
+static constexpr id_t   g_none {UINT32_MAX};
+static constexpr size_t g_block{size_t{64} << 10};
+//------------------------------------
+  id_t intern(std::string_view s)
+  {
+    if (const auto it = index_.find(s); it != index_.end())
+      return it->second;
+
+    const auto id   = static_cast<id_t>(strings_.size());
+    const auto view = store(s);
+    strings_.push_back(view);
+    index_.emplace(view, id);
+    return id;
+  }
+//------------------------------------
+  id_t find(std::string_view s) const
+  {
+    const auto it = index_.find(s);
+    return (it != index_.end()) ? it->second : g_none;
+  }
+//------------------------------------
+  std::string_view view(id_t id) const
+  {
+    return (id < strings_.size()) ? strings_[id] : std::string_view{};
+  }
+//------------------------------------
+  size_t size () const { return strings_.size(); }
+  size_t bytes() const
+  {
+    return blocks_.size() * g_block + large_bytes_ + strings_.capacity() * sizeof(std::string_view) +
+           index_.size() * (sizeof(std::string_view) + sizeof(id_t) + 2 * sizeof(void*));
+  }
+//------------------------------------
+private:
+  std::string_view store(std::string_view s)
+  {
+    if (s.size() > g_block / 4)                    // Large strings get a block of their own
+    {
+      large_.push_back(std::make_unique<char[]>(s.size()));
+      std::memcpy(large_.back().get(), s.data(), s.size());
+      large_bytes_ += s.size();
+      return {large_.back().get(), s.size()};
+    }
+
+    if (blocks_.empty() || used_ + s.size() > g_block)
+    {
+      blocks_.push_back(std::make_unique<char[]>(g_block));
+      used_ = 0;
+    }
+
+    char* dest = blocks_.back().get() + used_;
+    std::memcpy(dest, s.data(), s.size());
+    used_ += s.size();
+    return {dest, s.size()};
+  }
+//------------------------------------
+  std::vector<std::unique_ptr<char[]>>       blocks_;
+  std::vector<std::unique_ptr<char[]>>       large_;
+  size_t                                     used_       {0};
+  size_t                                     large_bytes_{0};
+  std::vector<std::string_view>              strings_;
+  std::unordered_map<std::string_view, id_t> index_;
+};
+} // ns kiq::katrix
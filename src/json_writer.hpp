@@ -0,0 +1,113 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Minimal streaming JSON writer over a reusable buffer. Strings are escaped per RFC 8259;
+// separators are inserted automatically. Nesting is limited to 64 levels.
+//-------------------------------------------------------------
+class json_writer
+{
+public:
+  explicit json_writer(size_t reserve = 256)
+  {
+    out_.reserve(reserve);
+  }
+//------------------------------------
+  json_writer& begin_object() { separate(); out_ += '{'; push(); return *this; }
+  json_writer& end_object  () { out_ += '}'; depth_--;           return *this; }
+  json_writer& begin_array () { separate(); out_ += '['; push(); return *this; }
+  json_writer& end_array   () { out_ += ']'; depth_--;           return *this; }
+//------------------------------------
+  json_writer& key(std::string_view k)
+  {
+    separate();
+    escape(k);
+    out_ += ':';
+    after_key_ = true;
+    return *this;
+  }
+//------------------------------------
+  json_writer& value(std::string_view v) { separate(); escape(v);                          return *this; }
+  json_writer& value(const char* v)      { return value(std::string_view{v});                            }
+  json_writer& value(bool v)             { separate(); out_ += v ? "true" : "false";       return *this; }
+  json_writer& value(int64_t v)
+  {
+    separate();
+    char       buf[24];
+    const auto res = std::to_chars(buf, buf + sizeof(buf), v);
+    out_.append(buf, res.ptr);
+    return *this;
+  }
+//------------------------------------
+  template <typename T>
+  json_writer& field(std::string_view k, T&& v)
+  {
+    return key(k).value(std::forward<T>(v));
+  }
+//------------------------------------
+  void               clear()       { out_.clear(); depth_ = 0; first_ = 0; after_key_ = false; }
+  const std::string& str  () const { return out_; }
+//------------------------------------
+private:
+  void push()
+  {
+    depth_++;
+    first_ |= uint64_t{1} << depth_ % 64;
+  }
+//------------------------------------
+  void separate()
+  {
+    if (after_key_)
+    {
+      after_key_ = false;
+      return;
+    }
+    if (!depth_)
+      return;
+
+    const uint64_t bit = uint64_t{1} << depth_ % 64;
+    if (first_ & bit)
+      first_ &= ~bit;
+    else
+      out_ += ',';
+  }
+//------------------------------------
+  void escape(std::string_view s)
+  {
+    static const char* g_hex{"0123456789abcdef"};
+    out_ += '"';
+    for (const char c : s)
+      switch (c)
+      {
+        case '"':  out_ += "\\\""; break;
+        case '\\': out_ += "\\\\"; break;
+        case '\b': out_ += "\\b";  break;
+        case '\f': out_ += "\\f";  break;
+        case '\n': out_ += "\\n";  break;
+        case '\r': out_ += "\\r";  break;
+        case '\t': out_ += "\\t";  break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20)
+          {
+            out_ += "\\u00";
+            out_ += g_hex[(c >> 4) & 0x0F];
+            out_ += g_hex[c & 0x0F];
+          }
+          else
+            out_ += c;
+      }
+    out_ += '"';
+  }
+//------------------------------------
+  std::string out_;
+  size_t      depth_    {0};
+  uint64_t    first_    {0};
+  bool        after_key_{false};
+};
+} // ns kiq::katrix
@@ -1,9 +1,22 @@
 #pragma once
 
 #include <unordered_set>
+#include <variant>
 #include "helper.hpp"
 #include "server.hpp"
+#include "event_loop.hpp"
+#include "config.hpp"
+#include "scheduler.hpp"
+#include "rate.hpp"
+#include "media_cache.hpp"
+#include "alloc_stats.hpp"
+#include "state_store.hpp"
+#include "alias_cache.hpp"
+#include "delivery.hpp"
+#include "metrics.hpp"
+#include <charconv>
 #include <csignal>
+#include <filesystem>
 #include <nlohmann/json.hpp>
 
 namespace kiq::katrix {
@@ -53,6 +66,7 @@ enum class ResponseType
   user_info,
   file_created,
   file_uploaded,
+  stats,
   unknown
 };
 //------------------------------------------------
@@ -94,17 +108,21 @@ struct TXMessage
   };
 //------------------------------------------------
   using Files_t = std::vector<TXMessage::File>;
-  TXMessage(const std::string& msg, const std::string& id, const std::vector<std::string>& urls)
+  TXMessage(const std::string& msg, const std::string& id, const std::vector<std::string>& urls, CallbackFunction cb = nullptr)
   : message(msg),
     room_id(id),
     mx_count(urls.size()),
-    files([](auto paths) { Files_t f{}; for (const auto& p : paths) f.emplace_back(File{p}); return f; }(urls))
+    files([](auto paths) { Files_t f{}; for (const auto& p : paths) f.emplace_back(File{p}); return f; }(urls)),
+    on_finish(std::move(cb))
   {}
 //------------------------------------------------
-  std::string message;
-  std::string room_id;
-  size_t      mx_count;
-  Files_t     files;
+  std::string                            message;
+  std::string                            room_id;
+  size_t                                 mx_count;
+  Files_t                                files;
+  CallbackFunction                       on_finish;
+  std::optional<mtx::http::ClientError>  error;      // First upload failure, owned
+  std::string                            txn;
 };
 //------------------------------------------------
 //------------------------------------------------
@@ -128,50 +146,81 @@ public:
 KatrixBot(const std::string& server,
           const std::string& user = "",
           const std::string& pass = "",
-          const std::string& room = "")
-: m_username(user),
-  m_password(pass),
-  m_room_id (room)
+          const std::string& room = "",
+          const server_options& options = {})
+: KatrixBot(config{.server = server, .user = user, .pass = pass, .room = room, .session = "", .media_cache = "", .ipc = options})
+{}
+//------------------------------------------------
+// Each bot owns its client and session. Given a shared server, the bot does not read it:
+// a bot_pool does, and hands requests over through submit().
+KatrixBot(const config& cfg, server* shared = nullptr)
+: m_username    (cfg.user),
+  m_password    (cfg.pass),
+  m_room_id     (cfg.room),
+  m_own_server  (shared ? nullptr : std::make_unique<server>(cfg.ipc)),
+  m_server      (shared ? *shared : *m_own_server),
+  m_uploader    (cfg.upload),
+  m_media       (cfg.media_cache, cfg.media_capacity),
+  m_scheduler   (cfg.scheduling),
+  m_aliases     (cfg.aliases),
+  m_delivery    (cfg.scheduled),
+  m_max_sends   (std::max(cfg.max_sends, size_t{1})),
+  m_metrics_path(cfg.metrics_file),
+  m_session_path(cfg.session),
+  m_session     (session::load(cfg.session)),
+  m_filter      (cfg.sync)
+{
+  // A resumed session skips the initial sync, so rooms quiet since the restart would
+  // otherwise be unknown by alias
+  m_aliases.for_each([this](const std::string& room, const std::vector<std::string>& aliases)
+  {
+    for (const auto& alias : aliases)
+      m_state.remember_alias(alias, room);
+  });
+  m_client = std::make_shared<mtx::http::Client>(cfg.server, cfg.port);
+  if (!cfg.verify_tls)
+    m_client->verify_certificates(false);
+  if (m_own_server)
+    m_loop.watch(m_server.fd(), [this]
+    {
+      m_server.clear();
+      process_channel();
+      process_queue();
+    });
+  m_loop.post([this] { dump_metrics(); });
+  m_loop.post([this] { prune_rooms();  });
+  m_dispatcher = std::async(std::launch::async, [this] { m_loop.run(); });
+  m_worker     = std::async(std::launch::async, [this] { m_io.run();   });
+}
+//------------------------------------------------
+~KatrixBot()
 {
-  g_client = std::make_shared<mtx::http::Client>(server);
+  m_io.stop();
+  m_loop.stop();
+  if (m_worker.valid())
+    m_worker.wait();
+  if (m_dispatcher.valid())
+    m_dispatcher.wait();
+  m_aliases.write(m_aliases.snapshot());         // A posted write may not have run
+  m_media  .write(m_media.snapshot());
+  std::lock_guard<std::mutex> lock(m_session_mutex);
+  m_session.save(m_session_path);
 }
 //------------------------------------------------
-void send_media_message(const std::string& room_id, const std::string& msg, const std::vector<std::string>& paths, CallbackFunction on_finish = nullptr)
+void send_media_message(const std::string& room_id, const std::string& msg, const std::vector<std::string>& paths, CallbackFunction on_finish = nullptr,
+                        const std::string& txn = "")
 {
-  m_uploading = (!paths.empty());
   klog().d("Sending media message with {} urls", paths.size());
-  m_tx_queue.push_back(TXMessage{msg, room_id, paths});
-  auto callback = [this, &room_id, on_finish = std::move(on_finish)](mtx::responses::ContentURI uri, RequestError e)
-  {
-    klog().d("Media message callback received uri: {}", uri.content_uri);
-    if (e) print_error(e);
-    else
-    {
-      for (auto it = m_tx_queue.begin(); it != m_tx_queue.end();)
-      {
-        for (TXMessage::File& file : it->files)
-        {
-          if (!file.ready())
-          {
-            file.mtx_url = uri.content_uri;
-            it->mx_count--;
-          }
-        }
-        if (!(it->mx_count))
-        {
-          klog().t("Sending another media message");
-          send_media  (it->room_id, it->files);
-          send_message(it->room_id, {it->message}, {}, on_finish);
-          it = m_tx_queue.erase(it);
-          m_uploading = false;
-        }
-        else
-          it++;
-      }
-    }
-  };
-  for (const auto& path : paths)
-    upload(path, callback);
+  if (paths.empty())
+    return send_message(room_id, Msg_t{msg}, on_finish, txn);
+
+  const auto id = ++m_tx_id;
+  m_tx_queue.emplace(id, TXMessage{msg, room_id, paths, std::move(on_finish)});
+  m_tx_queue.at(id).txn = txn;
+  for (size_t i = 0; i < paths.size(); i++)
+    m_uploads.emplace_back(id, i);
+
+  start_uploads();
 }
 //------------------------------------------------
 template <typename T = TXMessage::Files_t>
@@ -185,12 +234,70 @@ void send_media(const std::string& id, T&& files)
       send_message<Video_t>(id, get_file_type<Video_t>(file));
 }
 //------------------------------------------------
+// Sends parts one after another, so they arrive in order; cb follows the last part, or
+// the first failure. Part i of a transaction uses the transaction id "<txn>.<i>".
+using part_t  = std::variant<Msg_t, Image_t, Video_t>;
+using parts_t = std::shared_ptr<std::vector<part_t>>;
+void send_parts(const std::string& room_id, parts_t parts, size_t index, const std::string& txn, CallbackFunction cb)
+{
+  auto next = [this, room_id, parts, index, txn, cb](std::string resp, ResponseType type, ReqErr err)
+  {
+    if (err || index + 1 == parts->size())
+    {
+      if (cb)
+        cb(resp, type, err);
+      return;
+    }
+    send_parts(room_id, parts, index + 1, txn, cb);
+  };
+
+  const auto part_txn = txn.empty() ? txn : txn + '.' + std::to_string(index);
+  std::visit([&](const auto& msg) { send_message(room_id, msg, next, part_txn); }, (*parts)[index]);
+}
+//------------------------------------------------
+// With a transaction id, a send that fails in transit or with a server error is retried
+// under the same id, so the homeserver can discard a duplicate. Rate limited sends wait
+// the time asked for and go again, holding their room's place in line.
 template <typename T = Msg_t>
-void send_message(const std::string& room_id, const T& msg, const std::vector<std::string>& media = {}, CallbackFunction cb = nullptr)
+void send_message(const std::string& room_id, const T& msg, CallbackFunction cb = nullptr, const std::string& txn = "", int attempt = 0)
 {
+  static const int  g_max_attempts{4};
+  static const auto g_backoff     {std::chrono::seconds(2)};
+
   klog().i("Sending message to {}", room_id);
-  auto callback = [this, cb = std::move(cb)](EventID res, RequestError e)
+  auto callback = [this, room_id, msg, cb = std::move(cb), txn, attempt, start = std::chrono::steady_clock::now()](EventID res, RequestError e)
   {
+    stats().send_latency.record(std::chrono::steady_clock::now() - start);
+    if (rate_limited(e))
+      stats().limited.add();
+    else
+    if (e)
+      stats().send_errors.add();
+    else
+      stats().sends.add();
+
+    if (rate_limited(e))
+      return m_loop.post([this, room_id, msg, cb, txn, attempt, retry = retry_after(e)]
+      {
+        m_rates.on_limited(endpoint_t::send, retry);
+        m_loop.schedule(retry, [this, room_id, msg, cb, txn, attempt] { send_message<T>(room_id, msg, cb, txn, attempt); });
+      });
+
+    if (e && !txn.empty() && (e->status_code == 0 || e->status_code >= 500) && attempt + 1 < g_max_attempts)
+    {
+      klog().w("Send of transaction {} failed with status {}. Retrying", txn, e->status_code);
+      return m_loop.post([this, room_id, msg, cb, txn, attempt]
+      {
+        m_loop.schedule(g_backoff * (attempt + 1), [this, room_id, msg, cb, txn, attempt]
+        {
+          send_message<T>(room_id, msg, cb, txn, attempt + 1);
+        });
+      });
+    }
+
+    if (!e)
+      m_loop.post([this] { m_rates.on_success(endpoint_t::send); });
+
     klog().d("Message send callback event: {}", res.event_id.to_string());
     if (e)
       print_error(e);
@@ -198,54 +305,72 @@ void send_message(const std::string& room_id, const T& msg, const std::vector<st
       cb(res.event_id.to_string(), get_response_type<T>(), e);
   };
 
-  g_client->send_room_message<T>(room_id, {msg}, callback);
+  if (txn.empty())
+    m_client->send_room_message<T>(room_id, {msg}, callback);
+  else
+    m_client->send_room_message<T>(room_id, txn, {msg}, callback);
 }
 //------------------------------------------------
 template <typename T = std::string>
-void login(const T& username = "", const T& password = "")
+std::future<bool> login(const T& username = "", const T& password = "")
 {
-  klog().i("{} is logging in", username);
   if (!username.empty())
   {
     m_username = username;
     m_password = password;
   }
 
-  g_client->login(m_username, m_password, &login_handler);
+  auto promise = std::make_shared<std::promise<bool>>();
+  auto result  = promise->get_future();
+  authenticate([promise](bool success) { promise->set_value(success); });
+  return result;
 }
 //------------------------------------------------
 using UploadCallback = std::function<void(mtx::responses::ContentURI, RequestError)>;
 void upload(const std::string& path, UploadCallback cb)
 {
-  auto get_clean_path = [&path]
-  {
-    const auto pos = path.find("://");
-    return (pos != std::string::npos) ? path.substr(pos + 3) : path;
-  };
+  if (!m_rates.acquire(endpoint_t::upload))
+    return m_loop.schedule(m_rates.wait_time(endpoint_t::upload), [this, path, cb] { upload(path, cb); });
 
   klog().d("Uploading file with path {}", path);
 
-  const auto bytes    = kutils::ReadFile(get_clean_path());
+  const auto clean    = clean_path(path);
   const auto pos      = path.find_last_of("/");
   const auto filename = (pos == std::string::npos) ? path : path.substr(pos + 1);
+  std::error_code ec;
+  const auto      size     = std::filesystem::file_size(clean, ec);
+  auto            callback = [this, path, cb, size = ec ? 0 : size, start = std::chrono::steady_clock::now()](mtx::responses::ContentURI uri, RequestError e)
+  {
+    if (rate_limited(e))
+      return m_loop.post([this, path, cb, retry = retry_after(e)]
+      {
+        m_rates.on_limited(endpoint_t::upload, retry);
+        upload(path, cb);
+      });
 
-  g_client->upload(bytes, "application/octet-stream", filename, cb);
+    if (!e)
+    {
+      stats().uploads     .add();
+      stats().upload_bytes.add(size);
+      stats().upload_time .record(std::chrono::steady_clock::now() - start);
+      m_loop.post([this] { m_rates.on_success(endpoint_t::upload); });
+    }
+    cb(uri, e);
+  };
+
+  m_uploader.submit(stream_uploader::job{clean, filename, "application/octet-stream",
+    "https://" + m_client->server() + ':' + std::to_string(m_client->port()), m_client->access_token(), callback});
 }
 //------------------------------------------------
 void run(bool error = false)
 {
   try
   {
-    if (error)
-    {
-      login();
-      while (!logged_in()) ;
-    }
+    if (error && !login().get())
+      throw std::runtime_error{"Failed to log in"};
 
-    SyncOpts opts;
-    opts.timeout = 0;
-    g_client->sync(opts, [this](const auto& resp, const auto& err) { initial_sync_handler(resp, err); });
-    g_client->close();
+    start_sync();
+    m_client->close();
   }
   catch(const std::exception& e)
   {
@@ -260,7 +385,7 @@ void run(bool error = false)
 //------------------------------------------------
 bool logged_in() const
 {
-  return g_client->access_token().size() > 0;
+  return m_client->access_token().size() > 0;
 }
 //------------------------------------------------
 void get_user_info(CallbackFunction cb)
@@ -273,85 +398,276 @@ void get_user_info(CallbackFunction cb)
     if (e)
       print_error(e);
     else
-      data = to_json(res, m_username);
+      data = set_info(res);
 
     cb(data, ResponseType::user_info, e);
   };
 
-  g_client->presence_status("@" + m_username + ":" + g_client->server(), callback);
+  m_client->presence_status("@" + m_username + ":" + m_client->server(), callback);
 }
 //------------------------------------------------
-void fetch_rooms()
+// Looks up published aliases for the given rooms, unless the cache holds a fresh result
+// (including "none") or a lookup is already outstanding
+void fetch_rooms(const std::vector<std::string>& rooms)
 {
-  for (const auto& [id, aliases] : m_rooms)
-    if (aliases.empty())
-      g_client->list_room_aliases(id, [this, id](auto res, auto err) { m_rooms[id] = res.aliases; });
+  {
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    for (const auto& id : rooms)
+      if (const auto cached = m_aliases.find(id); cached && !cached->empty())
+        if (const auto room = m_state.find(id); room && room->aliases.empty())
+          m_state.set_aliases(m_state.room(id), *cached);
+  }
+
+  for (const auto& id : rooms)
+    if (m_aliases.acquire(id))
+      m_client->list_room_aliases(id, [this, id](auto res, auto err)
+      {
+        m_loop.post([this, id, err, aliases = std::move(res.aliases)]() mutable
+        {
+          if (err)
+          {
+            print_error(err);
+            return m_aliases.fail(id);
+          }
+
+          {
+            std::lock_guard<std::mutex> lock(m_state_mutex);
+            if (m_state.find(id))
+              m_state.set_aliases(m_state.room(id), aliases);
+          }
+          m_aliases.store(id, std::move(aliases));
+          save_aliases();
+        });
+      });
+}
+//------------------------------------------------
+// Writes the alias cache on the I/O thread, at most once per interval
+void save_aliases()
+{
+  static const auto g_interval = std::chrono::seconds(10);
+  if (m_aliases_saving)
+    return;
+
+  m_aliases_saving = true;
+  m_loop.schedule(g_interval, [this]
+  {
+    m_aliases_saving = false;
+    if (m_aliases.dirty())
+      m_io.post([this, data = m_aliases.snapshot()] { m_aliases.write(data); });
+  });
 }
 //------------------------------------------------
 rooms_t
 get_rooms(CallbackFunction callback) const
 {
+  rooms_t rooms;
+  {
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    m_state.for_each_room([this, &rooms](const auto& room)
+    {
+      auto& aliases = rooms[std::string{m_state.view(room.id)}];
+      for (const auto alias : room.aliases)
+        aliases.emplace_back(m_state.view(alias));
+    });
+  }
+
   if (callback)
+    callback(rooms_snapshot(), ResponseType::rooms, {});
+
+  return rooms;
+}
+//------------------------------------------------
+// matrix:rooms as "<id>,<alias>" lines, rebuilt only when the state store has changed.
+// Returned by value: the cached text may be rebuilt by another caller once the lock drops.
+std::string rooms_snapshot() const
+{
+  std::lock_guard<std::mutex> lock(m_state_mutex);
+  if (m_rooms_version == m_state.version())
+    return m_rooms_text;
+
+  m_rooms_text.clear();
+  m_state.for_each_room([this](const auto& room)
   {
-    std::string rooms;
-    for (const auto& [id, aliases] : m_rooms)
-      if (!aliases.empty())
-        rooms += id + ',' + aliases.front() + '\n';
-    callback(rooms, ResponseType::rooms, {});
+    if (!room.aliases.empty())
+      m_rooms_text.append(m_state.view(room.id)).append(1, ',').append(m_state.view(room.aliases.front())).append(1, '\n');
+  });
+  m_rooms_version = m_state.version();
+  return m_rooms_text;
+}
+//------------------------------------------------
+void apply_presence(const mtx::responses::Sync& res)
+{
+  const auto self = m_client->user_id().to_string();
+  for (const auto& event : res.presence)
+    if (event.sender == self)
+      set_info(event.content);
+}
+//------------------------------------------------
+static membership_t to_membership(mtx::events::state::Membership membership)
+{
+  using mtx::events::state::Membership;
+  switch (membership)
+  {
+    case Membership::Join:   return membership_t::join;
+    case Membership::Invite: return membership_t::invite;
+    case Membership::Knock:  return membership_t::knock;
+    case Membership::Ban:    return membership_t::ban;
+    default:                 return membership_t::none;
   }
+}
+//------------------------------------------------
+// Folds the state carried by a sync response into m_state. Rooms left are dropped; for
+// joined rooms, state and timeline events update names, aliases, members and powers,
+// and the bot's own membership is recorded as joined. Returns the rooms whose canonical
+// alias changed.
+std::vector<std::string> apply_state(const mtx::responses::Sync& res)
+{
+  namespace state = mtx::events::state;
+  using mtx::events::StateEvent;
+
+  std::vector<std::string>    changed;
+  const auto                  self = m_client->user_id().to_string();
+  std::lock_guard<std::mutex> lock(m_state_mutex);
+  m_state.set_self(self);
+  for (const auto& [id, room] : res.rooms.leave)
+    m_state.remove(id);
 
-  return m_rooms;
+  for (const auto& [id, room] : res.rooms.join)
+  {
+    auto& entry = m_state.room(id);
+    auto  apply = [this, &entry, &changed, &id](const auto& event)
+    {
+      using event_t = std::decay_t<decltype(event)>;
+      if constexpr (std::is_same_v<event_t, StateEvent<state::Name>>)
+        m_state.set_name(entry, event.content.name);
+      else
+      if constexpr (std::is_same_v<event_t, StateEvent<state::CanonicalAlias>>)
+      {
+        m_state.set_canonical_alias(entry, event.content.alias, event.content.alt_aliases);
+        changed.push_back(id);
+      }
+      else
+      if constexpr (std::is_same_v<event_t, StateEvent<state::Member>>)
+        m_state.set_membership(entry, event.state_key, to_membership(event.content.membership));
+      else
+      if constexpr (std::is_same_v<event_t, StateEvent<state::PowerLevels>>)
+        m_state.set_powers(entry, static_cast<int32_t>(event.content.users_default),
+          std::vector<std::pair<std::string, int32_t>>(event.content.users.begin(), event.content.users.end()));
+    };
+
+    for (const auto& event : room.state.events)
+      std::visit(apply, event);
+    for (const auto& event : room.timeline.events)
+      std::visit(apply, event);
+    m_state.set_membership(entry, self, membership_t::join); // Listed under rooms.join: joined as of this batch
+  }
+
+  return changed;
 }
 //------------------------------------------------
 void sync_handler(const mtx::responses::Sync &res, RequestErr err)
 {
   auto callback = [](const mtx::responses::EventId &, RequestErr e) { if (e) print_error(e); };
-  SyncOpts opts;
+  SyncOpts opts = sync_options();
 
     if (err)
     {
       klog().e("Sync error");
       print_error(err);
-      opts.since = g_client->next_batch_token();
-      g_client->sync(opts, [this] (const auto& resp, const auto& err) { sync_handler(resp, err); });
+      if (unauthorized(err))
+        return reauthenticate();
+      if (err->status_code == 400 && drop_filter())
+        return start_sync();
+      opts.since = m_client->next_batch_token();
+      sync(opts);
       return;
     }
 
+    opts.since = res.next_batch;
+    m_client->set_next_batch_token(res.next_batch);
+    sync(opts);
+    checkpoint(res.next_batch);
+
+    std::vector<std::string> active;
+    auto                     changed = apply_state(res);
+    apply_presence(res);
     for (const auto &room : res.rooms.join)
     {
-      if (!m_rooms.contains(room.first))
-        m_rooms[room.first] = {};
+      active.push_back(room.first);
       for (const auto &msg : room.second.timeline.events)
         print_message(msg);
     }
 
-    opts.since = res.next_batch;
-    g_client->set_next_batch_token(res.next_batch);
-    g_client->sync(opts, [this](const auto& resp, const auto& err) { sync_handler(resp, err); });
+    m_loop.post([this, active = std::move(active), changed = std::move(changed)]
+    {
+      for (const auto& id : changed)
+        m_aliases.invalidate(id);
+      fetch_rooms(active);
+    });
+}
+//------------------------------------------------
+void process_channel()
+{
+  if (!m_ready || !m_own_server)
+    return;
 
-    process_channel();
+  while (auto msg = m_server.get_msg())
+  {
+    klog().d("Processing server message");
+    const auto allocs = alloc_stats::count();
+    if (auto req = m_converter.receive(std::move(msg)))
+      process_request(std::move(*req));
+
+    if (alloc_stats::enabled())
+      klog().t("Request processing made {} allocations", alloc_stats::count() - allocs);
+  }
+  compact_delivery();
+}
+//------------------------------------------------
+// Takes a request from a bot_pool. Those arriving before the first sync are held until it
+void submit(request_t req)
+{
+  m_submitted++;
+  m_loop.post([this, req = std::make_shared<request_t>(std::move(req))]
+  {
+    if (!m_ready)
+      return m_inbox.push_back(std::move(*req));
+    accept(std::move(*req));
     process_queue();
-    fetch_rooms();
+  });
 }
 //------------------------------------------------
-void process_channel()
+void accept(request_t&& req)
+{
+  m_accepted++;
+  process_request(std::move(req));
+}
+//------------------------------------------------
+// Requests handed over and not yet sent, for routing to the least busy account
+size_t load() const
+{
+  return m_submitted - m_accepted + m_backlog;
+}
+//------------------------------------------------
+// Synced, or resumed with its joined rooms fetched, and taking requests
+bool ready() const
+{
+  return m_ready;
+}
+//------------------------------------------------
+// From the member table: the bot's own membership, as of the last sync
+bool joined(const std::string& room) const
 {
-  while (m_server.has_msgs())
-   {
-     klog().d("Processing server message");
-     process_request(m_converter.receive(std::move(m_server.get_msg())));
-   }
+  std::lock_guard<std::mutex> lock(m_state_mutex);
+  return m_state.joined(room);
 }
 //------------------------------------------------
-void process_request(const request_t& req)
+void process_request(request_t req)
 {
-  auto callback = [this, req](auto resp, auto type, auto err)
+  auto callback = [this, id = req.id, info = req.info](auto resp, auto type, auto err)
   {
-    request_t out = req;
-    if (req.info)
-      out.text = resp;
-    klog().t("Request callback invoked with id {} and text {}", out.id, out.text);
-    m_server.reply(out, !err);
+    klog().t("Request callback invoked with id {} and text {}", id, resp);
+    m_server.reply(id, !err, info ? resp : "");
   };
 
   klog().t("Processing request");
@@ -359,47 +675,268 @@ void process_request(const request_t& req)
   {
     klog().d("Info request of type {}", req.text);
     if (req.text == "matrix:info")
-      get_user_info(callback);
+    {
+      if (const auto info = get_info(); !info.empty())
+        callback(info, ResponseType::user_info, {});
+      else
+        get_user_info(callback);                     // Primes the snapshot
+    }
     else
     if (req.text == "matrix:rooms")
-      get_rooms(callback);
+      callback(rooms_snapshot(), ResponseType::rooms, {});
+    else
+    if (req.text == "matrix:stats")
+      callback(stats().to_json(gauges()), ResponseType::stats, {});
+    else
+    if (req.text == "matrix:prometheus")
+      callback(stats().to_prometheus(gauges()), ResponseType::stats, {});
     else
       klog().w("Failed to handle info request");
     return;
   }
 
-  m_queue.push_back([this, rx = std::move(req), cb = std::move(callback)]
+  auto room = resolve_room(req.room);
+  if (room.empty() && !req.room.empty())
+    return lookup_alias(std::move(req));
+
+  if (room.empty())
+  {
+    klog().w("Unable to resolve room {} for request {}", req.room, req.id);
+    return m_server.reply(req, false);
+  }
+
+  if (const auto due = delivery_queue::parse_time(req.time); due > delivery_queue::now())
+  {
+    klog().d("Scheduling request {} for {}", req.id, req.time);
+    const auto id = req.id;
+    req.room      = std::move(room);
+    m_delivery.add(std::move(req), due);
+    const bool saved = m_delivery.sync();            // On disk before kiq is told
+    arm_delivery();
+    return m_server.reply(id, saved);
+  }
+
+  queue_request(std::move(room), std::move(req), std::move(callback));
+}
+//------------------------------------------------
+// An empty callback marks a request with no one waiting on a reply, which is also never
+// purged as stale
+void queue_request(std::string room, request_t req, CallbackFunction callback = nullptr)
+{
+  const auto priority = req.priority;
+  auto       id       = callback ? req.id : std::string{};
+  m_scheduler.push(room, priority, [this, room, rx = std::move(req), cb = std::move(callback)]
   {
+    auto done = [this, room, cb](std::string resp, ResponseType type, ReqErr err)
+    {
+      if (cb)
+        cb(resp, type, err);
+      m_loop.post([this, room] { on_sent(room); });
+    };
+
+    const auto txn = txn_id(rx.id);
     if (rx.media.empty())
     {
-      klog().i("Sending \"{}\" msg to {}", rx.text, m_room_id);
-      return send_message(m_room_id, Msg_t{rx.text}, {}, cb);
+      klog().i("Sending \"{}\" msg to {}", rx.text, room);
+      return send_message(room, Msg_t{rx.text}, done, txn);
     }
 
-    send_media_message(m_room_id, {rx.text}, { kutils::urls_from_string(rx.media).front() }, cb); // Only send one file
+    send_media_message(room, {rx.text}, kutils::urls_from_string(rx.media), done, txn);
+  }, std::move(id));
+  m_backlog = m_scheduler.size() + m_sending;
+}
+//------------------------------------------------
+// Queue depths and other levels sampled for the stats responses
+metrics::gauges_t gauges()
+{
+  metrics::gauges_t gauges{
+    {"ipc_queue",        m_server.queued()},
+    {"ipc_pending",      m_server.pending()},
+    {"ipc_outstanding",  m_server.depth()},
+    {"send_queue",       m_scheduler.size()},
+    {"send_rooms",       m_scheduler.rooms()},
+    {"sends_in_flight",  m_sending},
+    {"tx_queue",         m_tx_queue.size()},
+    {"upload_queue",     m_uploads.size()},
+    {"scheduled",        m_delivery.size()},
+    {"send_rate_per_min", static_cast<uint64_t>(m_rates.per_minute(endpoint_t::send))}};
+  {
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    gauges.emplace_back("rooms",       m_state.rooms());
+    gauges.emplace_back("state_bytes", m_state.bytes());
+  }
+  if (alloc_stats::enabled())
+    gauges.emplace_back("loop_allocations", alloc_stats::count());
+  return gauges;
+}
+//------------------------------------------------
+// Writes the Prometheus text to metrics_file periodically, for a textfile collector
+void dump_metrics()
+{
+  static const auto g_interval = std::chrono::seconds(15);
+  if (m_metrics_path.empty())
+    return;
+
+  m_loop.schedule(g_interval, [this]
+  {
+    if (!write_file(m_metrics_path, stats().to_prometheus(gauges())))
+      klog().w("Failed to write metrics to {}", m_metrics_path);
+    dump_metrics();
+  });
+}
+//------------------------------------------------
+// Forgets rooms the scheduler holds no work or rate state for
+void prune_rooms()
+{
+  static const auto g_interval = std::chrono::minutes(1);
+  m_loop.schedule(g_interval, [this]
+  {
+    if (const auto n = m_scheduler.prune())
+      klog().t("Forgot {} idle rooms. {} rooms tracked", n, m_scheduler.rooms());
+    prune_rooms();
+  });
+}
+//------------------------------------------------
+void on_sent(const std::string& room)
+{
+  m_sending--;
+  m_backlog = m_scheduler.size() + m_sending;
+  m_scheduler.release(room);
+  process_queue();
+}
+//------------------------------------------------
+// Stable per kiq request, so a resend of the same request reuses the transaction id
+static std::string txn_id(const std::string& request_id)
+{
+  uint64_t hash{14695981039346656037ULL};                       // FNV-1a
+  for (const unsigned char c : request_id)
+  {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+
+  char       buf[16];
+  const auto res = std::to_chars(buf, buf + sizeof(buf), hash, 16);
+  return "kiq." + std::string(buf, res.ptr);
+}
+//------------------------------------------------
+// Wakes when the earliest scheduled post is due. A post added with an earlier time
+// re-arms; the timer it replaces finds its generation stale and does nothing.
+void arm_delivery()
+{
+  if (m_delivery.empty())
+    return;
+
+  const auto due = m_delivery.next_due();
+  if (m_delivery_wake && m_delivery_wake <= due)
+    return;
+
+  const auto delay = std::chrono::seconds(std::max(due - delivery_queue::now(), int64_t{1}));
+  m_delivery_wake  = due;
+  m_loop.schedule(delay, [this, generation = ++m_delivery_timer]
+  {
+    if (generation != m_delivery_timer)
+      return;
+
+    m_delivery_wake = 0;
+    size_t due{0};
+    m_delivery.advance([this, &due](request_t&& req)
+    {
+      auto room = req.room;
+      klog().i("Scheduled request {} is due", req.id);
+      queue_request(std::move(room), std::move(req));
+      due++;
+    });
+
+    if (due)
+      process_queue();
+    compact_delivery();
+    arm_delivery();
   });
 }
 //------------------------------------------------
+// Rewrites the delivery journal on the I/O thread once enough of it is dead
+void compact_delivery()
+{
+  if (!m_delivery.compaction_due())
+    return;
+
+  m_io.post([this, job = m_delivery.begin_compaction()]
+  {
+    m_loop.post([this, written = job()] { m_delivery.finish_compaction(written); });
+  });
+}
+//------------------------------------------------
+// Asks the directory for an alias neither sync nor the cache knows, then retries with
+// the room id it returns
+void lookup_alias(request_t req)
+{
+  const auto alias = req.room;
+  m_client->resolve_room_alias(alias, [this, req = std::make_shared<request_t>(std::move(req))](const mtx::responses::RoomId& res, RequestErr err)
+  {
+    m_loop.post([this, req, room = err ? std::string{} : res.room_id]
+    {
+      if (room.empty())
+      {
+        klog().w("Unable to resolve room {} for request {}", req->room, req->id);
+        return m_server.reply(*req, false);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_state_mutex);
+        m_state.remember_alias(req->room, room);
+      }
+      req->room = room;
+      process_request(std::move(*req));
+      process_queue();
+    });
+  });
+}
+//------------------------------------------------
+std::string resolve_room(const std::string& room) const
+{
+  if (room.empty())
+    return m_room_id;
+
+  if (room.front() != '#')
+    return room;
+
+  std::lock_guard<std::mutex> lock(m_state_mutex);
+  return std::string{m_state.room_for_alias(room)};
+}
+//------------------------------------------------
 void initial_sync_handler(const mtx::responses::Sync &res, RequestErr err)
 {
-  SyncOpts opts;
+  SyncOpts opts = sync_options();
 
   if (err)
   {
     klog().e("error during initial sync");
     print_error(err);
+    if (unauthorized(err))
+      return reauthenticate();
+    if (err->status_code == 400 && drop_filter())
+      return start_sync();
     if (err->status_code != 200)
     {
       klog().w("retrying initial sync ...");
       opts.timeout = 0;
-      g_client->sync(opts, [this](const auto& resp, const auto& err) { initial_sync_handler(resp, err); });
+      sync(opts, true);
     }
     return;
   }
 
   opts.since = res.next_batch;
-  g_client->set_next_batch_token(res.next_batch);
-  g_client->sync(opts, [this](const auto& resp, const auto& err) { sync_handler(resp, err); });
+  m_client->set_next_batch_token(res.next_batch);
+  sync(opts);
+  checkpoint(res.next_batch);
+  apply_state(res);
+  apply_presence(res);
+  std::vector<std::string> joined;
+  for (const auto& room : res.rooms.join)
+    joined.push_back(room.first);
+  m_loop.post([this, joined = std::move(joined)] { fetch_rooms(joined); });
+  on_ready();
 }
 
 //------------------------------------------------
@@ -419,31 +956,460 @@ void vote(const std::string& answer, const std::string& name)
 //------------------------------------------------
 private:
 //------------------------------------------------
+void start_uploads()
+{
+  static const size_t g_max_uploads{4};
+  while (m_active_uploads < g_max_uploads && !m_uploads.empty())
+  {
+    const auto [id, index] = m_uploads.front();
+    m_uploads.pop_front();
+
+    const auto it = m_tx_queue.find(id);
+    if (it == m_tx_queue.end())
+      continue;
+
+    m_active_uploads++;
+    cached_upload(it->second.files[index].filename, [this, id, index](mtx::responses::ContentURI uri, RequestError e)
+    {
+      klog().d("Media message callback received uri: {}", uri.content_uri);
+      m_loop.post([this, id, index, uri, e] { on_uploaded(id, index, uri, e); });
+    });
+  }
+}
+//------------------------------------------------
+// The file is stat'ed, and hashed unless unchanged since last time, on the I/O thread
+void cached_upload(const std::string& path, UploadCallback cb)
+{
+  const auto clean = clean_path(path);
+  m_io.post([this, path, clean, cb, known = m_media.recorded(clean)]
+  {
+    m_loop.post([this, path, clean, cb, stamp = media_cache::fingerprint(clean, known)]
+    {
+      if (const auto mxc = m_media.find_hash(stamp.hash))
+      {
+        klog().d("Media cache hit for {}", path);
+        m_media.insert(clean, stamp, *mxc);
+        save_media();
+        return cb(mtx::responses::ContentURI{*mxc}, {});
+      }
+
+      upload(path, [this, clean, stamp, cb](mtx::responses::ContentURI uri, RequestError e)
+      {
+        if (!e)
+          m_loop.post([this, clean, stamp, mxc = uri.content_uri]
+          {
+            m_media.insert(clean, stamp, mxc);
+            save_media();
+          });
+        cb(uri, e);
+      });
+    });
+  });
+}
+//------------------------------------------------
+// Writes the media index on the I/O thread, at most once per interval
+void save_media()
+{
+  static const auto g_interval = std::chrono::seconds(10);
+  if (m_media_saving)
+    return;
+
+  m_media_saving = true;
+  m_loop.schedule(g_interval, [this]
+  {
+    m_media_saving = false;
+    if (m_media.dirty())
+      m_io.post([this, data = m_media.snapshot()] { m_media.write(data); });
+  });
+}
+//------------------------------------------------
+static std::string clean_path(const std::string& path)
+{
+  const auto pos = path.find("://");
+  return (pos != std::string::npos) ? path.substr(pos + 3) : path;
+}
+//------------------------------------------------
+void on_uploaded(uint64_t id, size_t index, const mtx::responses::ContentURI& uri, const RequestError& e)
+{
+  m_active_uploads--;
+
+  if (auto it = m_tx_queue.find(id); it != m_tx_queue.end())
+  {
+    TXMessage& tx = it->second;
+    if (e)
+    {
+      print_error(e);
+      tx.error = e;
+    }
+    else
+      tx.files[index].mtx_url = uri.content_uri;
+
+    if (!--tx.mx_count)
+    {
+      if (tx.error)
+      {
+        klog().e("Failed to upload media for message to {}", tx.room_id);
+        if (tx.on_finish)
+          tx.on_finish("", ResponseType::file_uploaded, tx.error);
+      }
+      else
+      {
+        klog().t("Sending media message with {} files", tx.files.size());
+        auto parts = std::make_shared<std::vector<part_t>>();
+        parts->reserve(tx.files.size() + 1);
+        for (const auto& file : tx.files)
+          if (file.mime.IsPhoto())
+            parts->emplace_back(get_file_type<Image_t>(file));
+          else
+            parts->emplace_back(get_file_type<Video_t>(file));
+        parts->emplace_back(Msg_t{tx.message});
+        send_parts(tx.room_id, std::move(parts), 0, tx.txn, tx.on_finish);
+      }
+      m_tx_queue.erase(it);
+    }
+  }
+
+  start_uploads();
+}
+//------------------------------------------------
+// The configured user may be a full id ("@name:server") or a localpart
+bool is_configured_user(const std::string& user_id) const
+{
+  if (m_username.starts_with('@'))
+    return user_id == m_username;
+  return user_id.starts_with('@' + m_username + ':');
+}
+//------------------------------------------------
+void authenticate(std::function<void(bool)> on_done)
+{
+  std::unique_lock<std::mutex> lock(m_session_mutex);
+  if (m_session.valid() && !is_configured_user(m_session.user_id))
+    klog().w("Saved session is for {}, not {}. Logging in afresh", m_session.user_id, m_username);
+  else
+  if (m_session.valid())
+  {
+    klog().i("Resuming session for {} with device id {}", m_session.user_id, m_session.device_id);
+    m_client->set_user       (mtx::identifiers::parse<mtx::identifiers::User>(m_session.user_id));
+    m_client->set_device_id  (m_session.device_id);
+    m_client->set_access_token(m_session.access_token);
+    lock.unlock();
+    return on_done(true);
+  }
+  lock.unlock();
+
+  klog().i("{} is logging in", m_username);
+  m_client->login(m_username, m_password, [this, on_done = std::move(on_done)](const mtx::responses::Login& res, RequestErr err)
+  {
+    login_handler(*m_client, res, err);
+    if (!err)
+    {
+      std::lock_guard<std::mutex> lock(m_session_mutex);
+      if (m_session.user_id != res.user_id.to_string())
+      {
+        m_session.filter_id.clear();
+        m_session.filter   .clear();
+      }
+      m_session.user_id      = res.user_id.to_string();
+      m_session.device_id    = res.device_id;
+      m_session.access_token = res.access_token;
+      m_session.next_batch.clear();
+      m_session.save(m_session_path);
+    }
+    on_done(!err);
+  });
+}
+//------------------------------------------------
+void reauthenticate()
+{
+  klog().w("Session is no longer valid. Logging in again");
+  {
+    std::lock_guard<std::mutex> lock(m_session_mutex);
+    session fresh;
+    fresh.user_id   = m_session.user_id; // Keeps the filter if the same user logs back in
+    fresh.filter_id = m_session.filter_id;
+    fresh.filter    = m_session.filter;
+    m_session = std::move(fresh);
+    m_session.save(m_session_path);
+  }
+
+  authenticate([this](bool success)
+  {
+    if (success)
+      start_sync();
+    else
+      klog().e("Failed to log in again");
+  });
+}
+//------------------------------------------------
+void start_sync()
+{
+  if (!filter_ready([this] { start_sync(); }))
+    return;
+
+  SyncOpts          opts = sync_options();
+  const std::string since = [this]
+  {
+    std::lock_guard<std::mutex> lock(m_session_mutex);
+    return m_session.next_batch;
+  }();
+
+  if (since.empty())
+  {
+    opts.timeout = 0;
+    sync(opts, true);
+    return;
+  }
+
+  klog().i("Resuming sync from {}", since);
+  opts.since = since;
+  m_client->set_next_batch_token(since);
+  seed_rooms([this, opts]
+  {
+    sync(opts);
+    on_ready();
+  });
+}
+//------------------------------------------------
+// A resumed session skips the initial sync, which is what lists the joined rooms, so
+// they are fetched instead; otherwise joined() knows a room only once it syncs activity
+void seed_rooms(std::function<void()> on_done)
+{
+  m_client->joined_rooms([this, on_done = std::move(on_done)](const mtx::responses::JoinedRooms& res, RequestErr err)
+  {
+    if (err)
+    {
+      klog().w("Failed to fetch joined rooms");
+      print_error(err);
+    }
+    else
+    {
+      const auto                  self = m_client->user_id().to_string();
+      std::lock_guard<std::mutex> lock(m_state_mutex);
+      m_state.set_self(self);
+      for (const auto& id : res.rooms)
+        m_state.set_membership(m_state.room(id), self, membership_t::join);
+      klog().i("Joined to {} rooms", res.rooms.size());
+    }
+    on_done();
+  });
+}
+//------------------------------------------------
+void sync(const SyncOpts& opts, bool initial = false)
+{
+  m_sync_started = std::chrono::steady_clock::now().time_since_epoch().count();
+  m_client->sync(opts, [this, initial](const mtx::responses::Sync& res, RequestErr err)
+  {
+    stats().syncs.add();
+    stats().sync_rtt.record(std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(m_sync_started.load()));
+    if (!err)
+    {
+      uint64_t events = res.presence.size();
+      for (const auto& [id, room] : res.rooms.join)
+        events += room.state.events.size() + room.timeline.events.size();
+      stats().sync_events.add(events);
+      stats().sync_size  .record(events);
+    }
+
+    if (initial)
+      initial_sync_handler(res, err);
+    else
+      sync_handler(res, err);
+  });
+}
+//------------------------------------------------
+SyncOpts sync_options()
+{
+  SyncOpts opts;
+  if (m_filter.enabled && !m_filter_failed)
+  {
+    std::lock_guard<std::mutex> lock(m_session_mutex);
+    opts.filter = m_session.filter_id;
+  }
+  return opts;
+}
+//------------------------------------------------
+// Returns true if sync can start now. Otherwise the filter is uploaded first, and `then`
+// is called once it is stored (or has failed, in which case sync runs unfiltered).
+bool filter_ready(std::function<void()> then)
+{
+  if (!m_filter.enabled || m_filter_failed)
+    return true;
+
+  const auto definition = m_filter.definition(m_client->user_id().to_string());
+  auto       digest     = definition.dump();
+  {
+    std::lock_guard<std::mutex> lock(m_session_mutex);
+    if (!m_session.filter_id.empty() && m_session.filter == digest)
+      return true;
+  }
+
+  klog().i("Uploading sync filter");
+  m_client->upload_filter(definition, [this, digest = std::move(digest), then = std::move(then)](const mtx::responses::FilterId& res, RequestErr err)
+  {
+    if (err)
+    {
+      print_error(err);
+      klog().w("Failed to upload sync filter. Syncing without one");
+      m_filter_failed = true;
+    }
+    else
+    {
+      klog().i("Using sync filter {}", res.filter_id);
+      std::lock_guard<std::mutex> lock(m_session_mutex);
+      m_session.filter_id = res.filter_id;
+      m_session.filter    = digest;
+      m_session.save(m_session_path);
+    }
+    then();
+  });
+  return false;
+}
+//------------------------------------------------
+// A rejected filter is forgotten, and sync continues without one until the next start
+bool drop_filter()
+{
+  std::lock_guard<std::mutex> lock(m_session_mutex);
+  if (!m_filter.enabled || m_filter_failed || m_session.filter_id.empty())
+    return false;
+
+  klog().w("Sync filter {} was rejected", m_session.filter_id);
+  m_session.filter_id.clear();
+  m_session.save(m_session_path);
+  m_filter_failed = true;
+  return true;
+}
+//------------------------------------------------
+void on_ready()
+{
+  m_loop.post([this]
+  {
+    m_ready = true;
+    arm_delivery();
+    for (auto& req : std::exchange(m_inbox, {}))
+      accept(std::move(req));
+    process_channel();
+    process_queue();
+  });
+}
+//------------------------------------------------
+void checkpoint(const std::string& next_batch)
+{
+  static const auto g_interval = std::chrono::seconds(10);
+  std::lock_guard<std::mutex> lock(m_session_mutex);
+  m_session.next_batch = next_batch;
+  if (const auto now = std::chrono::steady_clock::now(); now - m_saved > g_interval)
+  {
+    m_session.save(m_session_path);
+    m_saved = now;
+  }
+}
+//------------------------------------------------
+static bool unauthorized(const RequestErr& err)
+{
+  return err && err->status_code == 401;
+}
+//------------------------------------------------
 void process_queue()
 {
-  while (!m_uploading && !m_queue.empty())
+  if (const auto expired = m_server.expired(); expired != m_expired)
+  {
+    m_expired = expired;
+    if (const auto n = m_scheduler.purge([this](const std::string& id) { return !m_server.is_pending(id); }))
+    {
+      klog().w("Dropped {} queued requests which timed out before dispatch. {} requests outstanding", n, m_server.depth());
+      m_backlog = m_scheduler.size() + m_sending;
+    }
+  }
+
+  while (!m_scheduler.empty() && m_sending < m_max_sends)
   {
-    if (!m_tokens.request(1))
+    if (!m_rates.has_token(endpoint_t::send))
+      return defer_queue(m_rates.wait_time(endpoint_t::send));
+
+    scheduler::duration_t wait;
+    auto                  fn = m_scheduler.pop(wait);
+    if (!fn)
+    {
+      if (wait != scheduler::duration_t::max())                 // Otherwise, rooms with work are busy
+        defer_queue(wait);
       return;
+    }
 
-    const auto fn = m_queue.front();
-    fn();
-    m_queue.pop_front();
+    m_rates.acquire(endpoint_t::send);
+    m_sending++;
+    (*fn)();
   }
 }
 //------------------------------------------------
-using queue_t = std::deque<std::function<void()>>;
+void defer_queue(scheduler::duration_t wait)
+{
+  if (m_deferred)
+    return;
+
+  m_deferred = true;
+  stats().stalls     .add();
+  stats().bucket_wait.record(wait);
+  m_loop.schedule(wait, [this]
+  {
+    m_deferred = false;
+    process_queue();
+  });
+}
+//------------------------------------------------
+using time_point = std::chrono::steady_clock::time_point;
+using tx_queue_t = std::map<uint64_t, TXMessage>;
+using uploads_t  = std::deque<std::pair<uint64_t, size_t>>;
+using client_t   = std::shared_ptr<mtx::http::Client>;
+using server_ptr = std::unique_ptr<server>;
 
 std::string           m_username;
 std::string           m_password;
 std::string           m_room_id;
-std::deque<TXMessage> m_tx_queue;
-server                m_server;
+client_t              m_client;
+tx_queue_t            m_tx_queue;
+uploads_t             m_uploads;
+uint64_t              m_tx_id{0};
+size_t                m_active_uploads{0};
+server_ptr            m_own_server;
+server&               m_server;
 request_converter     m_converter;
-bucket                m_tokens;
-queue_t               m_queue;
+rate_controller       m_rates;
+stream_uploader       m_uploader;
+media_cache           m_media;
+scheduler             m_scheduler;
 poll                  m_poll;
-rooms_t               m_rooms;
-bool                  m_uploading{false};
+state_store           m_state;
+mutable std::mutex    m_state_mutex;
+alias_cache           m_aliases;
+mutable std::string   m_rooms_text;
+mutable uint64_t      m_rooms_version{UINT64_MAX};
+std::string           m_info;
+mutable std::mutex    m_info_mutex;
+bool                  m_aliases_saving{false};
+bool                  m_media_saving  {false};
+delivery_queue        m_delivery;
+int64_t               m_delivery_wake {0};
+uint64_t              m_delivery_timer{0};
+size_t                m_max_sends;
+size_t                m_sending{0};
+std::deque<request_t> m_inbox;
+std::atomic<size_t>   m_submitted{0};
+std::atomic<size_t>   m_accepted {0};
+std::atomic<size_t>   m_backlog  {0};
+std::string           m_metrics_path;
+std::atomic<int64_t>  m_sync_started{0};
+std::atomic<bool>     m_ready   {false};
+bool                  m_deferred{false};
+uint64_t              m_expired {0};
+std::string           m_session_path;
+session               m_session;
+filter_options        m_filter;
+std::atomic<bool>     m_filter_failed{false};
+std::mutex            m_session_mutex;
+time_point            m_saved;
+event_loop            m_loop;
+event_loop            m_io;
+std::future<void>     m_dispatcher;
+std::future<void>     m_worker;
 };
 } // ns kiq::katrix
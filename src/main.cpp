@@ -1,23 +1,42 @@
 #include "katrix.hpp"
+#include "pool.hpp"
 
 int main(int argc, char* argv[])
 {
   kiq::katrix::klogger::init("katrix", "trace");
   auto log = kiq::katrix::klogger::instance();
 
-  std::string server = "";
-  std::string room   = "";
-  std::string msg    = "";
-  std::string path   = "";
-  std::string user   = "";
-  std::string pass   = "";
+  const auto config = kiq::katrix::config::load((argc > 1) ? argv[1] : "katrix.json");
 
-  kiq::katrix::KatrixBot bot{server, user, pass, room};
+  if (config.mode == "broker")
+  {
+    kiq::katrix::broker broker{config.ipc, config.broker};
+    broker.run();
+    return 0;
+  }
+
+  if (!config.accounts.empty())
+  {
+    kiq::katrix::bot_pool pool{config};
+    if (!pool.login())
+    {
+      log.e("Failed to log in");
+      return 1;
+    }
+
+    pool.run();
+    return 0;
+  }
+
+  kiq::katrix::KatrixBot bot{config};
+
+  if (!bot.login().get())
+  {
+    log.e("Failed to log in");
+    return 1;
+  }
 
-  bot.login();
-  while (!bot.logged_in()) ;
-  bot.send_media_message(room, msg, {path});
   bot.run();
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,201 @@
+#include "media_cache.hpp"
+#include "session.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <logger.hpp>
+#include <openssl/evp.h>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+static int64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+//----------------------------------
+static bool stat_file(const std::string& file, uint64_t& size, int64_t& mtime)
+{
+  struct stat info;
+  if (::stat(file.c_str(), &info) < 0)
+    return false;
+
+  size  = info.st_size;
+  mtime = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+  return true;
+}
+//-------------------------------------------------------------
+media_cache::media_cache(const std::string& path, size_t capacity)
+: path_    (path),
+  capacity_(std::max(capacity, size_t{1}))
+{
+  load();
+}
+//----------------------------------
+// What the index last recorded for file; fingerprint() decides whether it still holds
+std::optional<media_cache::stamp> media_cache::recorded(const std::string& file) const
+{
+  if (const auto it = files_.find(file); it != files_.end())
+    return it->second;
+  return std::nullopt;
+}
+//----------------------------------
+std::optional<std::string> media_cache::find_hash(const std::string& hash)
+{
+  const auto it = entries_.find(hash);
+  if (it == entries_.end())
+    return std::nullopt;
+
+  it->second.last_used = now();
+  dirty_               = true;
+  return it->second.mxc;
+}
+//----------------------------------
+void media_cache::insert(const std::string& file, const stamp& s, const std::string& mxc)
+{
+  if (s.hash.empty() || mxc.empty())
+    return;
+
+  entries_.insert_or_assign(s.hash, entry{mxc, now()});
+  files_  .insert_or_assign(file, s);
+  dirty_ = true;
+  evict();
+}
+//----------------------------------
+size_t media_cache::size() const
+{
+  return entries_.size();
+}
+//----------------------------------
+bool media_cache::dirty() const
+{
+  return dirty_;
+}
+//----------------------------------
+// Reuses the known hash when the file's size and mtime still match it
+media_cache::stamp media_cache::fingerprint(const std::string& file, const std::optional<stamp>& known)
+{
+  stamp s;
+  if (!stat_file(file, s.size, s.mtime))
+    return s;
+
+  s.hash = (known && known->size == s.size && known->mtime == s.mtime) ? known->hash : hash_file(file);
+  return s;
+}
+//----------------------------------
+std::string media_cache::hash_file(const std::string& file)
+{
+  static const size_t g_chunk{64 * 1024};
+  static const char*  g_hex  {"0123456789abcdef"};
+  const int           fd     = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return "";
+
+  std::vector<char> buffer(g_chunk);
+  unsigned char     digest[EVP_MAX_MD_SIZE];
+  unsigned int      length{0};
+  EVP_MD_CTX*       ctx = EVP_MD_CTX_new();
+  ssize_t           n;
+
+  EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+  while ((n = read(fd, buffer.data(), buffer.size())) > 0)
+    EVP_DigestUpdate(ctx, buffer.data(), n);
+  EVP_DigestFinal_ex(ctx, digest, &length);
+  EVP_MD_CTX_free(ctx);
+  close(fd);
+
+  if (n < 0)
+    return "";
+
+  std::string hash;
+  hash.reserve(length * 2);
+  for (unsigned int i = 0; i < length; i++)
+  {
+    hash += g_hex[digest[i] >> 4];
+    hash += g_hex[digest[i] & 0x0F];
+  }
+  return hash;
+}
+//----------------------------------
+// m <hash> <last_used> <mxc>
+// f <size> <mtime> <hash> <path>
+void media_cache::load()
+{
+  std::ifstream file{path_};
+  if (path_.empty() || !file)
+    return;
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream ss{line};
+    std::string        kind;
+    ss >> kind;
+    if (kind == "m")
+    {
+      std::string hash;
+      entry       e;
+      if (ss >> hash >> e.last_used >> e.mxc)
+        entries_.insert_or_assign(hash, std::move(e));
+    }
+    else
+    if (kind == "f")
+    {
+      stamp       s;
+      std::string name;
+      if (ss >> s.size >> s.mtime >> s.hash && std::getline(ss >> std::ws, name))
+        files_.insert_or_assign(name, std::move(s));
+    }
+  }
+
+  kiq::log::klog().d("Loaded {} cached media entries from {}", entries_.size(), path_);
+}
+//----------------------------------
+std::string media_cache::snapshot()
+{
+  std::string data;
+  data.reserve((entries_.size() + files_.size()) * 128);
+  for (const auto& [hash, e] : entries_)
+    data += "m\t" + hash + '\t' + std::to_string(e.last_used) + '\t' + e.mxc + '\n';
+  for (const auto& [name, s] : files_)
+    data += "f\t" + std::to_string(s.size) + '\t' + std::to_string(s.mtime) + '\t' + s.hash + '\t' + name + '\n';
+
+  dirty_ = false;
+  return data;
+}
+//----------------------------------
+bool media_cache::write(const std::string& data) const
+{
+  if (path_.empty())
+    return true;
+
+  if (write_file(path_, data))
+    return true;
+
+  kiq::log::klog().w("Failed to write media cache to {}", path_);
+  return false;
+}
+//----------------------------------
+void media_cache::evict()
+{
+  if (entries_.size() <= capacity_)
+    return;
+
+  std::vector<std::pair<int64_t, std::string>> by_age;
+  by_age.reserve(entries_.size());
+  for (const auto& [hash, e] : entries_)
+    by_age.emplace_back(e.last_used, hash);
+
+  const size_t remove = entries_.size() - capacity_ + capacity_ / 10;
+  std::nth_element(by_age.begin(), by_age.begin() + remove - 1, by_age.end());
+  for (size_t i = 0; i < remove; i++)
+    entries_.erase(by_age[i].second);
+
+  std::erase_if(files_, [this](const auto& item) { return !entries_.contains(item.second.hash); });
+}
+} // ns kiq::katrix
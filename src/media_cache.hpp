@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Maps SHA-256 of uploaded content to the mxc:// URI the homeserver returned for it.
+// A second table remembers each local file's size and mtime alongside its hash, so an
+// unchanged file is recognised without being read. Least recently used entries are
+// evicted past `capacity`.
+//
+// The cache itself does no file I/O after loading: fingerprint() stats and hashes a file
+// and write() persists a snapshot(), both meant for a worker thread. The index is a tab
+// separated file.
+//-------------------------------------------------------------
+class media_cache
+{
+struct entry
+{
+  std::string mxc;
+  int64_t     last_used;
+};
+//------------------------------------
+public:
+struct stamp
+{
+  uint64_t    size {0};
+  int64_t     mtime{0};
+  std::string hash;
+};
+//------------------------------------
+  explicit media_cache(const std::string& path = "", size_t capacity = 10000);
+
+  std::optional<stamp>       recorded (const std::string& file) const;
+  std::optional<std::string> find_hash(const std::string& hash);
+  void                       insert   (const std::string& file, const stamp& s, const std::string& mxc);
+  size_t                     size     () const;
+  bool                       dirty    () const;
+  std::string                snapshot ();
+  bool                       write    (const std::string& data) const;
+
+  static stamp               fingerprint(const std::string& file, const std::optional<stamp>& known = std::nullopt);
+  static std::string         hash_file  (const std::string& file);
+
+private:
+  void load ();
+  void evict();
+
+  std::string                            path_;
+  size_t                                 capacity_;
+  std::unordered_map<std::string, entry> entries_;
+  std::unordered_map<std::string, stamp> files_;
+  bool                                   dirty_{false};
+};
+} // ns kiq::katrix
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "json_writer.hpp"
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+class counter
+{
+public:
+  void     add  (uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const         { return value_.load(std::memory_order_relaxed);  }
+
+private:
+  std::atomic<uint64_t> value_{0};
+};
+//-------------------------------------------------------------
+// Log-linear histogram in the manner of HDR: each power of two is split into eight
+// sub-buckets, so any recorded value is reported within 12.5%. Recording is wait-free.
+//-------------------------------------------------------------
+class histogram
+{
+static constexpr size_t g_sub_bits{3};
+static constexpr size_t g_subs    {size_t{1} << g_sub_bits};
+static constexpr size_t g_buckets {(64 - g_sub_bits + 1) * g_subs};
+//------------------------------------
+public:
+  void record(uint64_t value)
+  {
+    buckets_[index(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1,     std::memory_order_relaxed);
+    sum_  .fetch_add(value, std::memory_order_relaxed);
+    for (uint64_t max = max_.load(std::memory_order_relaxed); value > max;)
+      if (max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        break;
+  }
+//------------------------------------
+  template <typename Duration>
+  void record(Duration d)
+  {
+    record(static_cast<uint64_t>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count(), 0)));
+  }
+//------------------------------------
+  // Upper bound of the bucket holding the q-th quantile, q in [0, 1]
+  uint64_t percentile(double q) const
+  {
+    const uint64_t total = count();
+    if (!total)
+      return 0;
+
+    const auto target = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+    uint64_t   seen{0};
+    for (size_t i = 0; i < g_buckets; i++)
+      if ((seen += buckets_[i].load(std::memory_order_relaxed)) >= target)
+        return std::min(upper(i), max());
+    return max();
+  }
+//------------------------------------
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t sum  () const { return sum_  .load(std::memory_order_relaxed); }
+  uint64_t max  () const { return max_  .load(std::memory_order_relaxed); }
+//------------------------------------
+private:
+  static size_t index(uint64_t v)
+  {
+    if (v < g_subs)
+      return static_cast<size_t>(v);
+    const size_t msb = 63 - std::countl_zero(v);
+    return (msb - g_sub_bits + 1) * g_subs + static_cast<size_t>((v >> (msb - g_sub_bits)) & (g_subs - 1));
+  }
+//------------------------------------
+  static uint64_t upper(size_t i)
+  {
+    if (i < g_subs)
+      return i;
+    const size_t shift = i / g_subs - 1;
+    return (((g_subs + i % g_subs + 1) << shift)) - 1;
+  }
+//------------------------------------
+  std::array<std::atomic<uint64_t>, g_buckets> buckets_{};
+  std::atomic<uint64_t>                        count_{0};
+  std::atomic<uint64_t>                        sum_  {0};
+  std::atomic<uint64_t>                        max_  {0};
+};
+//-------------------------------------------------------------
+// Process-wide instruments. Latencies are in microseconds. Depths are not kept here but
+// sampled by whoever renders, and passed in as gauges.
+//-------------------------------------------------------------
+struct metrics
+{
+using gauges_t = std::vector<std::pair<std::string_view, uint64_t>>;
+
+  counter   received;          // IPC requests accepted
+  counter   duplicates;        // IPC requests dropped as already seen
+  counter   rejected;          // IPC requests refused for lack of credit
+  counter   expired;           // Requests failed by timeout
+  counter   replies;           // Replies queued to kiq
+  counter   sends;             // Matrix sends acknowledged
+  counter   send_errors;       // Matrix sends failed
+  counter   limited;           // 429 responses
+  counter   stalls;            // Times the send queue waited on a token bucket
+  counter   uploads;
+  counter   upload_bytes;
+  counter   syncs;
+  counter   sync_events;
+
+  histogram ipc_queued;        // Received until dispatched
+  histogram ipc_process;       // Dispatched until replied
+  histogram ipc_total;         // Received until replied
+  histogram send_latency;      // Matrix send until acknowledged
+  histogram bucket_wait;       // Time the send queue was held for tokens
+  histogram upload_time;
+  histogram sync_rtt;
+  histogram sync_size;         // Events per sync response
+//------------------------------------
+  std::string to_json(const gauges_t& gauges = {}) const
+  {
+    json_writer writer{2048};
+    writer.begin_object();
+    for_each_counter([&writer](std::string_view name, const counter& c) { writer.field(name, static_cast<int64_t>(c.value())); });
+    for (const auto& [name, value] : gauges)
+      writer.field(name, static_cast<int64_t>(value));
+    for_each_histogram([&writer](std::string_view name, const histogram& h)
+    {
+      writer.key(name).begin_object()
+            .field("count", static_cast<int64_t>(h.count()))
+            .field("sum",   static_cast<int64_t>(h.sum()))
+            .field("p50",   static_cast<int64_t>(h.percentile(0.50)))
+            .field("p90",   static_cast<int64_t>(h.percentile(0.90)))
+            .field("p99",   static_cast<int64_t>(h.percentile(0.99)))
+            .field("max",   static_cast<int64_t>(h.max()))
+            .end_object();
+    });
+    writer.end_object();
+    return writer.str();
+  }
+//------------------------------------
+  // Prometheus text exposition format. Histograms are rendered as summaries.
+  std::string to_prometheus(const gauges_t& gauges = {}) const
+  {
+    std::string out;
+    out.reserve(4096);
+    auto line = [&out](std::string_view name, std::string_view suffix, uint64_t value)
+    {
+      out.append("katrix_").append(name).append(suffix).append(1, ' ').append(std::to_string(value)).append(1, '\n');
+    };
+
+    for_each_counter([&](std::string_view name, const counter& c)
+    {
+      out.append("# TYPE katrix_").append(name).append("_total counter\n");
+      line(name, "_total", c.value());
+    });
+    for (const auto& [name, value] : gauges)
+    {
+      out.append("# TYPE katrix_").append(name).append(" gauge\n");
+      line(name, "", value);
+    }
+    for_each_histogram([&](std::string_view name, const histogram& h)
+    {
+      out.append("# TYPE katrix_").append(name).append(" summary\n");
+      line(name, "{quantile=\"0.5\"}",  h.percentile(0.50));
+      line(name, "{quantile=\"0.9\"}",  h.percentile(0.90));
+      line(name, "{quantile=\"0.99\"}", h.percentile(0.99));
+      line(name, "_sum",   h.sum());
+      line(name, "_count", h.count());
+    });
+    return out;
+  }
+//------------------------------------
+private:
+  template <typename F>
+  void for_each_counter(F&& fn) const
+  {
+    fn("ipc_received",   received);
+    fn("ipc_duplicates", duplicates);
+    fn("ipc_rejected",   rejected);
+    fn("ipc_expired",    expired);
+    fn("ipc_replies",    replies);
+    fn("sends",          sends);
+    fn("send_errors",    send_errors);
+    fn("rate_limited",   limited);
+    fn("bucket_stalls",  stalls);
+    fn("uploads",        uploads);
+    fn("upload_bytes",   upload_bytes);
+    fn("syncs",          syncs);
+    fn("sync_events",    sync_events);
+  }
+//------------------------------------
+  template <typename F>
+  void for_each_histogram(F&& fn) const
+  {
+    fn("ipc_queued_us",      ipc_queued);
+    fn("ipc_process_us",     ipc_process);
+    fn("ipc_total_us",       ipc_total);
+    fn("send_latency_us",    send_latency);
+    fn("bucket_wait_us",     bucket_wait);
+    fn("upload_time_us",     upload_time);
+    fn("sync_rtt_us",        sync_rtt);
+    fn("sync_size_events",   sync_size);
+  }
+};
+//-------------------------------------------------------------
+inline metrics& stats()
+{
+  static metrics g_metrics;
+  return g_metrics;
+}
+} // ns kiq::katrix
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "timing_wheel.hpp"
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+struct pending_entry
+{
+  using clock_t    = std::chrono::steady_clock;
+  using time_point = clock_t::time_point;
+
+  std::string id;
+  bool        info{false};
+  std::string platform;
+  std::string type;
+  time_point  received;
+  time_point  dispatched;
+  time_point  replied;
+  uint64_t    generation{0};
+
+  template <typename T = std::chrono::microseconds>
+  auto queued()  const { return std::chrono::duration_cast<T>(dispatched - received).count();   }
+  template <typename T = std::chrono::microseconds>
+  auto process() const { return std::chrono::duration_cast<T>(replied    - dispatched).count(); }
+  template <typename T = std::chrono::microseconds>
+  auto total()   const { return std::chrono::duration_cast<T>(replied    - received).count();   }
+};
+//-------------------------------------------------------------
+// Requests awaiting a reply, indexed by id. Each entry is armed on a timing wheel when
+// added; entries replaced or taken before their deadline are skipped by generation.
+//-------------------------------------------------------------
+class pending_table
+{
+using clock_t    = pending_entry::clock_t;
+using duration_t = clock_t::duration;
+using timer_t    = std::pair<std::string, uint64_t>;
+static constexpr auto g_resolution = std::chrono::milliseconds(100);
+//------------------------------------
+public:
+  explicit pending_table(duration_t ttl)
+  : ttl_   (ttl),
+    expiry_(g_resolution)
+  {}
+//------------------------------------
+  // Returns false if the entry replaced one already pending under the same id
+  bool add(pending_entry entry)
+  {
+    entry.generation = ++generation_;
+    expiry_.add(entry.received + ttl_, timer_t{entry.id, entry.generation});
+    return index_.insert_or_assign(entry.id, std::move(entry)).second;
+  }
+//------------------------------------
+  bool contains(const std::string& id) const
+  {
+    return index_.find(id) != index_.end();
+  }
+//------------------------------------
+  std::optional<pending_entry> take(const std::string& id)
+  {
+    auto it = index_.find(id);
+    if (it == index_.end())
+      return std::nullopt;
+
+    pending_entry entry = std::move(it->second);
+    index_.erase(it);
+    entry.replied = clock_t::now();
+    return entry;
+  }
+//------------------------------------
+  template <typename F>
+  void expire(clock_t::time_point now, F&& on_timeout)
+  {
+    expiry_.advance(now, [this, &on_timeout, now](timer_t&& timer)
+    {
+      auto it = index_.find(timer.first);
+      if (it == index_.end() || it->second.generation != timer.second)
+        return;
+
+      pending_entry entry = std::move(it->second);
+      index_.erase(it);
+      entry.replied = now;
+      on_timeout(std::move(entry));
+    });
+  }
+//------------------------------------
+  size_t size () const { return index_.size();  }
+  bool   empty() const { return index_.empty(); }
+//------------------------------------
+private:
+  duration_t                                     ttl_;
+  timing_wheel<timer_t>                          expiry_;
+  std::unordered_map<std::string, pending_entry> index_;
+  uint64_t                                       generation_{0};
+};
+} // ns kiq::katrix
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include "katrix.hpp"
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Several accounts in one process, behind one IPC server. Each account is a KatrixBot
+// with its own client, session, sync and rate limits, so the pool can post at the sum
+// of their limits.
+//
+// With "affinity" routing a room stays with the account it was given to, chosen among
+// those joined to it by least load, so the room's posts keep their order. A room pinned
+// to an account not joined to it moves to one that is, and a pin is forgotten after
+// g_affinity_ttl without posts. With "least_loaded" each request goes
+// to the least busy account. Info requests are answered by the primary account.
+//-------------------------------------------------------------
+class bot_pool
+{
+enum class routing_t
+{
+  affinity,
+  least_loaded
+};
+using bots_t  = std::vector<std::unique_ptr<KatrixBot>>;
+using clock_t = std::chrono::steady_clock;
+struct pin_t
+{
+  size_t              account;
+  clock_t::time_point used;
+};
+static constexpr auto g_affinity_ttl = std::chrono::minutes(15);
+static constexpr auto g_hold_limit   = std::chrono::seconds(30);
+static constexpr auto g_hold_retry   = std::chrono::milliseconds(100);
+//------------------------------------
+public:
+  explicit bot_pool(const config& cfg)
+  : m_server (cfg.ipc),
+    m_routing(cfg.routing == "least_loaded" ? routing_t::least_loaded : routing_t::affinity)
+  {
+    m_bots.push_back(std::make_unique<KatrixBot>(cfg, &m_server));
+    for (const auto& account : cfg.accounts)
+      m_bots.push_back(std::make_unique<KatrixBot>(cfg.for_account(account), &m_server));
+
+    m_loop.watch(m_server.fd(), [this]
+    {
+      m_server.clear();
+      process_channel();
+    });
+    m_loop.post([this] { expire_affinity(); });
+    m_dispatcher = std::async(std::launch::async, [this] { m_loop.run(); });
+    klog().i("Running {} accounts with {} routing", m_bots.size(), cfg.routing);
+  }
+//------------------------------------
+  ~bot_pool()
+  {
+    m_loop.stop();
+    if (m_dispatcher.valid())
+      m_dispatcher.wait();
+  }
+//------------------------------------
+  bool login()
+  {
+    std::vector<std::future<bool>> results;
+    for (auto& bot : m_bots)
+      results.push_back(bot->login());
+
+    bool success{true};
+    for (size_t i = 0; i < results.size(); i++)
+      if (!results[i].get())
+      {
+        klog().e("Account {} failed to log in", i);
+        success = false;
+      }
+    return success;
+  }
+//------------------------------------
+  // Blocks while the accounts sync
+  void run()
+  {
+    std::vector<std::future<void>> runners;
+    for (auto& bot : m_bots)
+      runners.push_back(std::async(std::launch::async, [&bot] { bot->run(); }));
+    for (auto& runner : runners)
+      runner.wait();
+  }
+//------------------------------------
+  size_t size() const
+  {
+    return m_bots.size();
+  }
+//------------------------------------
+private:
+  void process_channel()
+  {
+    if (!ready())
+      return hold();
+
+    while (auto msg = m_server.get_msg())
+      if (auto req = m_converter.receive(std::move(msg)))
+      {
+        const auto index = route(*req);
+        m_bots[index]->submit(std::move(*req));
+      }
+  }
+//------------------------------------
+  // Until every account knows its joined rooms, routing cannot tell where a room
+  // belongs, so requests wait in the server for up to g_hold_limit
+  bool ready()
+  {
+    if (std::all_of(m_bots.begin(), m_bots.end(), [](const auto& bot) { return bot->ready(); }))
+      return true;
+
+    const auto now = clock_t::now();
+    if (m_held_since == clock_t::time_point{})
+      m_held_since = now;
+    return now - m_held_since > g_hold_limit;
+  }
+//------------------------------------
+  void hold()
+  {
+    if (m_holding)
+      return;
+
+    m_holding = true;
+    m_loop.schedule(g_hold_retry, [this]
+    {
+      m_holding = false;
+      process_channel();
+    });
+  }
+//------------------------------------
+  // Resolves the request's room, so the account it goes to need not know the alias
+  size_t route(request_t& req)
+  {
+    if (req.info)
+      return 0;
+
+    for (const auto& bot : m_bots)
+      if (auto room = bot->resolve_room(req.room); !room.empty())
+      {
+        req.room = std::move(room);
+        break;
+      }
+
+    if (m_routing == routing_t::least_loaded)
+      return least_loaded(req.room);
+
+    // A room is pinned on first use even if no account has joined it yet, so its posts
+    // keep their order. The pin moves only when the pinned account is not joined to the
+    // room and another account is.
+    const auto now = clock_t::now();
+    if (const auto it = m_affinity.find(req.room); it != m_affinity.end())
+    {
+      auto& pin = it->second;
+      pin.used  = now;
+      if (m_bots[pin.account]->joined(req.room))
+        return pin.account;
+
+      if (const auto index = least_loaded(req.room); index != pin.account && m_bots[index]->joined(req.room))
+      {
+        klog().i("Room {} moves from account {} to {}, which is joined to it", req.room, pin.account, index);
+        pin.account = index;
+      }
+      return pin.account;
+    }
+
+    const auto index = least_loaded(req.room);
+    m_affinity.emplace(req.room, pin_t{index, now});
+    klog().d("Room {} assigned to account {}", req.room, index);
+    return index;
+  }
+//------------------------------------
+  void expire_affinity()
+  {
+    m_loop.schedule(std::chrono::minutes(1), [this]
+    {
+      const auto now = clock_t::now();
+      std::erase_if(m_affinity, [now](const auto& item) { return now - item.second.used > g_affinity_ttl; });
+      expire_affinity();
+    });
+  }
+//------------------------------------
+  // Accounts joined to the room come first, then the lowest load
+  size_t least_loaded(const std::string& room) const
+  {
+    size_t best{0};
+    auto   best_key = std::make_pair(true, SIZE_MAX);
+    for (size_t i = 0; i < m_bots.size(); i++)
+      if (const auto key = std::make_pair(!m_bots[i]->joined(room), m_bots[i]->load()); key < best_key)
+      {
+        best     = i;
+        best_key = key;
+      }
+    return best;
+  }
+//------------------------------------
+  server                                  m_server;
+  bots_t                                  m_bots;
+  request_converter                       m_converter;
+  routing_t                               m_routing;
+  std::unordered_map<std::string, pin_t>  m_affinity;
+  clock_t::time_point                     m_held_since{};
+  bool                                    m_holding{false};
+  event_loop                              m_loop;
+  std::future<void>                       m_dispatcher;
+};
+} // ns kiq::katrix
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include "bucket.hpp"
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+enum class endpoint_t : uint8_t
+{
+  send,
+  upload
+};
+//-------------------------------------------------------------
+// AIMD rate control per endpoint class. Each success adds `g_step` requests per minute
+// up to `g_ceiling`; a 429 halves the rate and holds all requests until retry_after_ms
+// has passed. Bursts are capped at `g_burst` requests at the current rate.
+//-------------------------------------------------------------
+class rate_controller
+{
+using clock_t    = std::chrono::steady_clock;
+using duration_t = bucket::duration_t;
+static constexpr double g_initial{10.0};
+static constexpr double g_floor  {1.0};
+static constexpr double g_ceiling{600.0};
+static constexpr double g_step   {1.0};
+static constexpr double g_backoff{0.5};
+static constexpr int    g_burst  {4};
+
+struct limiter
+{
+  double              per_minute{g_initial};
+  bucket              tokens    {interval(g_initial), interval(g_initial) * g_burst};
+  clock_t::time_point blocked_until{};
+};
+//------------------------------------
+public:
+  bool acquire(endpoint_t endpoint)
+  {
+    auto& l = get(endpoint);
+    return clock_t::now() >= l.blocked_until && l.tokens.request(1);
+  }
+//------------------------------------
+  bool has_token(endpoint_t endpoint)
+  {
+    auto& l = get(endpoint);
+    return clock_t::now() >= l.blocked_until && l.tokens.has_token();
+  }
+//------------------------------------
+  duration_t wait_time(endpoint_t endpoint)
+  {
+    auto&      l       = get(endpoint);
+    const auto blocked = l.blocked_until - clock_t::now();
+    return std::max(l.tokens.wait_time(), std::chrono::duration_cast<duration_t>(blocked));
+  }
+//------------------------------------
+  void on_success(endpoint_t endpoint)
+  {
+    auto& l = get(endpoint);
+    if (l.per_minute < g_ceiling)
+      set(l, std::min(l.per_minute + g_step, g_ceiling));
+  }
+//------------------------------------
+  void on_limited(endpoint_t endpoint, std::chrono::milliseconds retry_after)
+  {
+    auto& l = get(endpoint);
+    set(l, std::max(l.per_minute * g_backoff, g_floor));
+    l.blocked_until = std::max(l.blocked_until, clock_t::now() + retry_after);
+    kiq::log::klog().w("Rate limited. Holding requests for {} ms at {:.1f} per minute", retry_after.count(), l.per_minute);
+  }
+//------------------------------------
+  double per_minute(endpoint_t endpoint) const
+  {
+    return limiters_[static_cast<size_t>(endpoint)].per_minute;
+  }
+//------------------------------------
+private:
+  static duration_t interval(double per_minute)
+  {
+    return std::chrono::duration_cast<duration_t>(std::chrono::duration<double, std::ratio<60>>(1.0 / per_minute));
+  }
+//------------------------------------
+  static void set(limiter& l, double per_minute)
+  {
+    l.per_minute = per_minute;
+    l.tokens.set_rate(interval(per_minute), interval(per_minute) * g_burst);
+  }
+//------------------------------------
+  limiter& get(endpoint_t endpoint)
+  {
+    return limiters_[static_cast<size_t>(endpoint)];
+  }
+//------------------------------------
+  std::array<limiter, 2> limiters_;
+};
+} // ns kiq::katrix
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Bounded lock-free queue (Vyukov). Each cell carries a sequence number which tells
+// producers and consumers whether it is free, so any number of either may share it.
+// Capacity is rounded up to a power of two.
+//-------------------------------------------------------------
+template <typename T>
+class ring
+{
+  struct cell
+  {
+    std::atomic<size_t> seq;
+    T                   data;
+  };
+
+  static size_t round_up(size_t n)
+  {
+    size_t v{2};
+    while (v < n)
+      v <<= 1;
+    return v;
+  }
+//------------------------------------
+public:
+  explicit ring(size_t capacity)
+  : mask_ (round_up(capacity) - 1),
+    cells_(std::make_unique<cell[]>(mask_ + 1))
+  {
+    for (size_t i = 0; i <= mask_; i++)
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+//------------------------------------
+  bool push(T&& value)
+  {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    cell*  c;
+    for (;;)
+    {
+      c = &cells_[pos & mask_];
+      const size_t seq  = c->seq.load(std::memory_order_acquire);
+      const auto   diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (!diff)
+      {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else
+      if (diff < 0)
+        return false; // full
+      else
+        pos = tail_.load(std::memory_order_relaxed);
+    }
+
+    c->data = std::move(value);
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+//------------------------------------
+  bool pop(T& value)
+  {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    cell*  c;
+    for (;;)
+    {
+      c = &cells_[pos & mask_];
+      const size_t seq  = c->seq.load(std::memory_order_acquire);
+      const auto   diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (!diff)
+      {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else
+      if (diff < 0)
+        return false; // empty
+      else
+        pos = head_.load(std::memory_order_relaxed);
+    }
+
+    value = std::move(c->data);
+    c->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+//------------------------------------
+  size_t size() const
+  {
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    const size_t head = head_.load(std::memory_order_acquire);
+    return (tail > head) ? tail - head : 0;
+  }
+//------------------------------------
+  bool   empty()    const { return !size();   }
+  size_t capacity() const { return mask_ + 1; }
+//------------------------------------
+private:
+  const size_t            mask_;
+  std::unique_ptr<cell[]> cells_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+};
+} // ns kiq::katrix
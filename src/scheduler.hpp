@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "bucket.hpp"
+#include "server.hpp"
+#include "task.hpp"
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+struct scheduler_options
+{
+  using duration_t = bucket::duration_t;
+  using weights_t  = std::unordered_map<std::string, uint32_t>;
+
+  duration_t room_rate {std::chrono::seconds(6)};  // One send per room per room_rate...
+  duration_t room_burst{std::chrono::minutes(1)};  // ...with bursts of up to room_burst / room_rate
+  weights_t  weights;                              // By room id; rooms not listed weigh 1
+};
+//-------------------------------------------------------------
+// Outbound queue with one token bucket per room. Priority classes are served strictly
+// in order; within a class, rooms with tokens are served by deficit round robin, so a
+// room of weight w gets w sends for every one sent to a room of weight 1. A room is
+// busy from the pop of one of its tasks until release(), so each room sends in order.
+// A busy room is taken off the active rings and put back by release(), so pop() never
+// steps over rooms it cannot serve. Rooms left idle with a full bucket are forgotten by
+// prune().
+//-------------------------------------------------------------
+class scheduler
+{
+public:
+using task_t     = task;
+using duration_t = bucket::duration_t;
+
+static constexpr size_t g_classes{3};
+//------------------------------------
+private:
+struct entry
+{
+  task_t      fn;
+  std::string key;
+};
+struct room_queue
+{
+  room_queue(const scheduler_options& options, uint32_t w)
+  : tokens(options.room_rate, options.room_burst),
+    weight(w)
+  {}
+
+  bool idle() const
+  {
+    return !busy && tokens.full() &&
+           std::all_of(tasks .begin(), tasks .end(), [](const auto& queue) { return queue.empty(); }) &&
+           std::none_of(queued.begin(), queued.end(), [](bool q) { return q; });
+  }
+
+  std::array<std::deque<entry>, g_classes>  tasks;
+  std::array<bool, g_classes>               queued{};  // On active_[class]; may linger once its tasks are purged
+  bucket                                    tokens;
+  uint32_t                                  weight;
+  uint32_t                                  deficit{0};
+  bool                                      busy   {false};
+};
+using ring_t = std::deque<std::string>;
+//------------------------------------
+public:
+  explicit scheduler(const scheduler_options& options = {})
+  : options_(options)
+  {}
+//------------------------------------
+  // `key` identifies the task to purge(); tasks without one are never purged
+  void push(const std::string& room, priority_t priority, task_t task, std::string key = {})
+  {
+    const auto cls   = static_cast<size_t>(priority);
+    auto&      queue = find(room);
+    queue.tasks[cls].push_back(entry{std::move(task), std::move(key)});
+    size_++;
+    if (!queue.busy)
+      enqueue(room, queue, cls);
+  }
+//------------------------------------
+  // Returns the next task whose room is idle and has a token, marking the room busy.
+  // Otherwise, `wait` is set to the time until the earliest blocked room can send again,
+  // or max() if the only rooms with work are busy.
+  std::optional<task_t> pop(duration_t& wait)
+  {
+    wait = duration_t::max();
+    for (size_t cls = 0; cls < g_classes; cls++)
+    {
+      ring_t& ring = active_[cls];
+      for (size_t i = 0, n = ring.size(); i < n; i++)
+      {
+        std::string id    = std::move(ring.front());
+        room_queue& queue = rooms_.at(id);
+        ring.pop_front();
+
+        if (queue.busy || queue.tasks[cls].empty())        // Purged, or queued before going busy
+        {
+          queue.queued[cls] = false;
+          continue;
+        }
+
+        if (!queue.tokens.has_token())
+        {
+          wait = std::min(wait, queue.tokens.wait_time());
+          ring.push_back(std::move(id));
+          continue;
+        }
+
+        if (!queue.deficit)
+          queue.deficit = queue.weight;
+
+        queue.tokens.request(1);
+        queue.busy        = true;
+        queue.queued[cls] = false;
+        task_t task       = std::move(queue.tasks[cls].front().fn);
+        queue.tasks[cls].pop_front();
+        queue.deficit--;
+        size_--;
+
+        if (queue.tasks[cls].empty())
+          queue.deficit = 0;
+
+        return task;
+      }
+    }
+    return std::nullopt;
+  }
+//------------------------------------
+  // Drops every keyed task for which stale(key) holds, without spending tokens on them.
+  // Emptied rooms leave the rings lazily, in pop().
+  template <typename F>
+  size_t purge(F&& stale)
+  {
+    size_t removed{0};
+    for (auto& [id, queue] : rooms_)
+      for (auto& tasks : queue.tasks)
+      {
+        const auto size = tasks.size();
+        tasks.erase(std::remove_if(tasks.begin(), tasks.end(), [&stale](const entry& e)
+        {
+          return !e.key.empty() && stale(e.key);
+        }), tasks.end());
+        removed += size - tasks.size();
+      }
+    size_ -= removed;
+    return removed;
+  }
+//------------------------------------
+  // The room rejoins the ring of each class it has work in; at the front while it has
+  // deficit left, so a weighted room keeps its turn
+  void release(const std::string& room)
+  {
+    const auto it = rooms_.find(room);
+    if (it == rooms_.end())
+      return;
+
+    it->second.busy = false;
+    for (size_t cls = 0; cls < g_classes; cls++)
+      if (!it->second.tasks[cls].empty())
+        enqueue(room, it->second, cls, it->second.deficit > 0);
+  }
+//------------------------------------
+  // Forgets rooms with nothing queued or in flight whose bucket has refilled, so a
+  // new task finds them exactly as a room never seen before
+  size_t prune()
+  {
+    return std::erase_if(rooms_, [](const auto& room) { return room.second.idle(); });
+  }
+//------------------------------------
+  void set_weight(const std::string& room, uint32_t weight)
+  {
+    weight                 = std::max(weight, uint32_t{1});
+    options_.weights[room] = weight;
+    if (const auto it = rooms_.find(room); it != rooms_.end())
+      it->second.weight = weight;
+  }
+//------------------------------------
+  size_t size (const std::string& room) const
+  {
+    size_t n{0};
+    if (const auto it = rooms_.find(room); it != rooms_.end())
+      for (const auto& tasks : it->second.tasks)
+        n += tasks.size();
+    return n;
+  }
+//------------------------------------
+  size_t size () const { return size_;  }
+  bool   empty() const { return !size_; }
+  size_t rooms() const { return rooms_.size(); }
+//------------------------------------
+private:
+  room_queue& find(const std::string& room)
+  {
+    if (const auto it = rooms_.find(room); it != rooms_.end())
+      return it->second;
+
+    const auto weight = options_.weights.find(room);
+    return rooms_.try_emplace(room, options_, weight == options_.weights.end() ? 1 : std::max(weight->second, uint32_t{1}))
+                 .first->second;
+  }
+//------------------------------------
+  void enqueue(const std::string& room, room_queue& queue, size_t cls, bool front = false)
+  {
+    if (queue.queued[cls])
+      return;
+
+    queue.queued[cls] = true;
+    if (front)
+      active_[cls].push_front(room);
+    else
+      active_[cls].push_back(room);
+  }
+//------------------------------------
+  scheduler_options                           options_;
+  std::unordered_map<std::string, room_queue> rooms_;
+  std::array<ring_t, g_classes>               active_;
+  size_t                                      size_{0};
+};
+} // ns kiq::katrix
@@ -1,60 +1,115 @@
 #include "server.hpp"
+#include "batch.hpp"
+#include "metrics.hpp"
+#include "worker.hpp"
 #include <logger.hpp>
+#include <nlohmann/json.hpp>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
 
-static const char* RX_ADDR{"tcp://0.0.0.0:28477"};
-static const char* TX_ADDR{"tcp://0.0.0.0:28478"};
-static const char* g_platform{"Matrix"};
+static const char*  g_platform{"Matrix"};
+static const size_t g_queue_size{1024};
+static const int    g_recv_timeout_ms{100};
+static const int    g_send_timeout_ms{1000};
+static const size_t g_zero_copy_min{4096};
 //----------------------------------------------------------------
 namespace kiq::katrix
 {
 //-------------------------------------------------------------
-request_t request_converter::receive(ipc_msg_t msg)
+static ipc_msg_t make_reply(const std::string& id, bool success)
 {
-  const auto type = msg->type();
-
-  if (type >= constants::IPC_PLATFORM_TYPE)
-    m_dispatch_table[type](std::move(msg));
-
-  return req;
+  if (success)
+    return std::make_unique<kiq::okay_message>(g_platform, id);
+  else
+    return std::make_unique<kiq::fail_message>(g_platform, id);
 }
-//----------------------------------
-struct req_parser
+//-------------------------------------------------------------
+static ipc_msg_t make_credit(const std::string& type, size_t credit, size_t depth)
 {
-request_t operator()(kiq::platform_message msg)
+  const auto info = nlohmann::json{{"credit", credit}, {"depth", depth}}.dump();
+  return std::make_unique<kiq::platform_info>(g_platform, info, type);
+}
+//-------------------------------------------------------------
+// platform_message::args() may name a target room, either directly ("!id:server" or
+// "#alias:server") or as JSON: {"room": "!id:server", "priority": "urgent"}
+static request_t parse(const platform_message& msg)
 {
-  return request_t{
-    .id    = msg.id     (),
-    .user  = msg.user   (),
-    .text  = msg.content(),
-    .media = msg.urls   (),
-    .time  = msg.time   ()};
+  request_t req;
+  req.id       = msg.id     ();
+  req.user     = msg.user   ();
+  req.text     = msg.content();
+  req.media    = msg.urls   ();
+  req.time     = msg.time   ();
+  req.priority = msg.repost () ? priority_t::bulk : priority_t::normal;
+
+  if (auto args = msg.args(); !args.empty())
+  {
+    if (args.front() == '!' || args.front() == '#')
+      req.room = std::move(args);
+    else
+    if (const auto json = nlohmann::json::parse(args, nullptr, false); json.is_object())
+    {
+      req.room = json.value("room", "");
+      if (const auto priority = json.value("priority", ""); priority == "urgent")
+        req.priority = priority_t::urgent;
+      else
+      if (priority == "bulk")
+        req.priority = priority_t::bulk;
+    }
+  }
+
+  return req;
 }
 //----------------------------------
-request_t operator()(kiq::platform_info msg)
+static request_t parse(const platform_info& msg)
 {
   request_t req;
   req.info = true;
   req.text = msg.type();
-  req.id   = msg.type();
+  req.id   = req.text;
   return req;
 }
-
-};
 //----------------------------------
-void request_converter::on_request(ipc_var_t msg)
+std::optional<request_t> request_converter::receive(ipc_msg_t msg) const
+{
+  if (!msg)
+    return std::nullopt;
+
+  switch (msg->type())
+  {
+    case constants::IPC_PLATFORM_TYPE: return parse(*static_cast<const platform_message*>(msg.get()));
+    case constants::IPC_PLATFORM_INFO: return parse(*static_cast<const platform_info*>   (msg.get()));
+    default:                           return std::nullopt;
+  }
+}
+//-------------------------------------------------------------
+static std::string worker_id(const server_options& options)
 {
-  static req_parser parser;
-  std::visit([this](auto msg) { req = parser(msg); }, msg);
+  if (!options.worker_id.empty())
+    return options.worker_id;
+
+  char host[256]{};
+  gethostname(host, sizeof(host) - 1);
+  return std::string{host} + '.' + std::to_string(getpid());
 }
 //-------------------------------------------------------------
-server::server()
+server::server(const server_options& options)
 : context_{1},
-  rx_(context_, ZMQ_ROUTER),
-  tx_(context_, ZMQ_DEALER)
+  rx_(context_, options.broker_addr.empty() ? ZMQ_ROUTER : ZMQ_DEALER),
+  tx_(context_, ZMQ_DEALER),
+  msgs_(std::max(options.max_pending, g_queue_size)),
+  wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  processed_(options.dedupe_capacity, options.dedupe_window),
+  pending_(options.request_ttl),
+  options_(options),
+  outbox_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  worker_(!options.broker_addr.empty())
 {
-  rx_.set(zmq::sockopt::linger, 0);
+  rx_.set(zmq::sockopt::linger, worker_ ? g_send_timeout_ms : 0);
   tx_.set(zmq::sockopt::linger, 0);
-  rx_.set(zmq::sockopt::routing_id, "katrix_daemon");
+  rx_.set(zmq::sockopt::routing_id, worker_ ? worker_id(options) : "katrix_daemon");
   tx_.set(zmq::sockopt::routing_id, "katrix_daemon_tx");
   rx_.set(zmq::sockopt::tcp_keepalive, 1);
   tx_.set(zmq::sockopt::tcp_keepalive, 1);
@@ -62,12 +117,28 @@ server::server()
   tx_.set(zmq::sockopt::tcp_keepalive_idle,  300);
   rx_.set(zmq::sockopt::tcp_keepalive_intvl, 300);
   tx_.set(zmq::sockopt::tcp_keepalive_intvl, 300);
+  rx_.set(zmq::sockopt::rcvtimeo, g_recv_timeout_ms);
+  tx_.set(zmq::sockopt::sndtimeo, g_send_timeout_ms);
+  rx_.set(zmq::sockopt::rcvhwm,   options.rx_hwm);
+  tx_.set(zmq::sockopt::sndhwm,   options.tx_hwm);
 
-  rx_.bind   (RX_ADDR);
-  tx_.connect(TX_ADDR);
+  if (worker_)
+  {
+    rx_.set(zmq::sockopt::sndtimeo, g_send_timeout_ms);
+    rx_.set(zmq::sockopt::sndhwm,   options.tx_hwm);
+    rx_.connect(options.broker_addr);
+  }
+  else
+  {
+    rx_.bind   (options.rx_addr);
+    tx_.connect(options.tx_addr);
+  }
 
   future_ = std::async(std::launch::async, [this] { run(); });
-  kiq::log::klog().i("Server listening on ", RX_ADDR);
+  if (worker_)
+    kiq::log::klog().i("Serving broker at {} as {}", options.broker_addr, rx_.get(zmq::sockopt::routing_id));
+  else
+    kiq::log::klog().i("Server listening on {}", options.rx_addr);
 
   kiq::set_log_fn([](const char* message) { kiq::log::klog().t(message); });
 }
@@ -77,6 +148,8 @@ server::~server()
   active_ = false;
   if (future_.valid())
     future_.wait();
+  close(outbox_fd_);
+  close(wake_fd_);
 }
 //----------------------------------
 bool server::is_active() const
@@ -86,15 +159,33 @@ bool server::is_active() const
 //----------------------------------
 ipc_msg_t server::get_msg()
 {
-  ipc_msg_t msg = std::move(msgs_.front());
-  msgs_.pop_front();
+  inbound_t in;
+  if (!msgs_.pop(in))
+    return nullptr;
 
-  if      (msg->type() == constants::IPC_PLATFORM_INFO)
-    pending_[static_cast<platform_info*>(msg.get())->type()]  = ipc_message::clone(*msg);
-  else if (msg->type() == constants::IPC_PLATFORM_TYPE)
-    pending_[static_cast<platform_message*>(msg.get())->id()] = ipc_message::clone(*msg);
+  pending_entry entry{.received = in.received, .dispatched = pending_entry::clock_t::now()};
+  if (in.msg->type() == constants::IPC_PLATFORM_INFO)
+  {
+    const auto info = static_cast<platform_info*>(in.msg.get());
+    entry.id        = info->type();
+    entry.info      = true;
+    entry.platform  = info->platform();
+    entry.type      = info->type();
+  }
+  else
+  if (in.msg->type() == constants::IPC_PLATFORM_TYPE)
+    entry.id = static_cast<platform_message*>(in.msg.get())->id();
+
+  if (entry.id.empty())
+    outstanding_--;
+  else
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    if (!pending_.add(std::move(entry)))
+      outstanding_--;
+  }
 
-  return msg;
+  return std::move(in.msg);
 }
 //----------------------------------
 bool server::has_msgs() const
@@ -102,95 +193,343 @@ bool server::has_msgs() const
   return !msgs_.empty();
 }
 //----------------------------------
+int server::fd() const
+{
+  return wake_fd_;
+}
+//----------------------------------
+size_t server::depth() const
+{
+  return outstanding_;
+}
+//----------------------------------
+size_t server::queued() const
+{
+  return msgs_.size();
+}
+//----------------------------------
+size_t server::pending()
+{
+  std::lock_guard<std::mutex> lock(pending_mutex_);
+  return pending_.size();
+}
+//----------------------------------
+uint64_t server::expired() const
+{
+  return expired_;
+}
+//----------------------------------
+bool server::is_pending(const std::string& id)
+{
+  std::lock_guard<std::mutex> lock(pending_mutex_);
+  return pending_.contains(id);
+}
+//----------------------------------
+zmq::context_t& server::context()
+{
+  return context_;
+}
+//----------------------------------
+void server::clear()
+{
+  uint64_t count;
+  while (read(wake_fd_, &count, sizeof(count)) > 0) ;
+}
+//----------------------------------
+void server::notify()
+{
+  const uint64_t count{1};
+  if (write(wake_fd_, &count, sizeof(count)) < 0)
+    kiq::log::klog().e("Failed to signal message consumer");
+}
+//----------------------------------
 void server::reply(const request_t& req, bool success)
 {
-  auto make_reply = [&](const auto id) -> ipc_msg_t
-  {
-    if (success)
-      return std::make_unique<kiq::okay_message>(g_platform, id);
-    else
-      return std::make_unique<kiq::fail_message>(g_platform, id);
-  };
+  reply(req.id, success, req.text);
+}
+//----------------------------------
+void server::reply(const std::string& id, bool success, const std::string& text)
+{
+  std::unique_lock<std::mutex> lock(pending_mutex_);
+  auto entry = pending_.take(id);
+  lock.unlock();
 
-  if (pending_.empty())
+  if (!entry)
   {
-    kiq::log::klog().d("Received reply value, but not currently waiting to reply. Ignoring: {}", req.id);
+    kiq::log::klog().d("Received reply value, but not currently waiting to reply. Ignoring: {}", id);
     return;
   }
+  outstanding_--;
+  stats().replies    .add();
+  stats().ipc_queued .record(entry->dispatched - entry->received);
+  stats().ipc_process.record(entry->replied    - entry->dispatched);
+  stats().ipc_total  .record(entry->replied    - entry->received);
 
   ipc_msg_t msg;
-  if (auto it = pending_.find(req.id); it != pending_.end())
+  if (success && entry->info)
+  {
+    msg = std::make_unique<platform_info>(entry->platform, text, entry->type);
+    kiq::log::klog().i("Platform Info is: {}", msg->to_string());
+  }
+  else
+    msg = make_reply(id, success);
+
+  kiq::log::klog().t("Queued reply of {} as response to {}", constants::IPC_MESSAGE_NAMES.at(msg->type()), id);
+  enqueue(std::move(msg));
+  kiq::log::klog().d("Request {} latency (us): queued {}, processed {}, total {}",
+    id, entry->queued(), entry->process(), entry->total());
+}
+//----------------------------------
+static void release_frame(void*, void* hint)
+{
+  delete static_cast<ipc_message::byte_buffer*>(hint);
+}
+//----------------------------------
+// Frames of g_zero_copy_min bytes or more are moved into zmq messages which free them
+// once sent; handing zmq a buffer costs two small allocations, so smaller ones are
+// copied. ipc_message::data() already returns a copy of the frames: kproto offers no
+// way around that, so a reply is copied once.
+void server::send(buffers_t&& frames)
+{
+  using buffer_t = ipc_message::byte_buffer;
+  auto& out = worker_ ? rx_ : tx_;
+  beat_     = clock_t::now();
+
+  const size_t frame_num = frames.size();
+  for (size_t i = 0; i < frame_num; i++)
   {
-    if (success && req.info)
+    const auto     flag = i == (frame_num - 1) ? zmq::send_flags::none : zmq::send_flags::sndmore;
+    zmq::message_t message;
+    if (frames[i].size() >= g_zero_copy_min)
     {
-      platform_info* data = static_cast<platform_info*>(it->second.get());
-      msg                 = std::make_unique<platform_info>(data->platform(), req.text, data->type());
-      kiq::log::klog().i("Platform Info is: {}", msg->to_string());
-      pending_.erase(it);
+      auto* frame = new buffer_t{std::move(frames[i])};
+      message.rebuild(frame->data(), frame->size(), &release_frame, frame);
     }
+    else
+    if (!frames[i].empty())
+      message.rebuild(frames[i].data(), frames[i].size());
+
+    if (!out.send(message, flag))
+      return kiq::log::klog().e("Dropped reply: peer is not reading and the send high-water mark was reached");
+  }
+}
+//----------------------------------
+void server::send(const ipc_msg_t& msg)
+{
+  send(msg->data());
+}
+//----------------------------------
+void server::control(std::string_view verb)
+{
+  send(worker::make<ipc_message::byte_buffer>(verb));
+}
+//----------------------------------
+void server::enqueue(ipc_msg_t msg)
+{
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    if (outbox_.empty())
+      outbox_since_ = clock_t::now();
+    outbox_.push_back(std::move(msg));
   }
 
-  if (!msg)
-    msg = make_reply(req.id);
+  const uint64_t count{1};
+  if (write(outbox_fd_, &count, sizeof(count)) < 0)
+    kiq::log::klog().e("Failed to signal reply queue");
+}
+//----------------------------------
+void server::flush()
+{
+  std::vector<ipc_msg_t> out;
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex_);
+    if (outbox_.empty())
+      return;
 
-  const auto&  payload   = msg->data();
-  const size_t frame_num = payload.size();
+    const bool batching = options_.batch_replies || batch_peer_;
+    if (batching && outbox_.size() < options_.reply_batch &&
+        clock_t::now() - outbox_since_ < options_.reply_window)
+      return;
 
-  for (int i = 0; i < frame_num; i++)
+    out.swap(outbox_);
+  }
+
+  if (out.size() == 1 || !(options_.batch_replies || batch_peer_))
   {
-    const auto flag = i == (frame_num - 1) ? zmq::send_flags::none : zmq::send_flags::sndmore;
-    const auto data = payload.at(i);
+    for (const auto& msg : out)
+      send(msg);
+    return;
+  }
 
-    zmq::message_t message{data.size()};
-    std::memcpy(message.data(), data.data(), data.size());
+  for (size_t i = 0; i < out.size(); i += options_.reply_batch)
+  {
+    const size_t           n = std::min(options_.reply_batch, out.size() - i);
+    std::vector<buffers_t> messages;
+    messages.reserve(n);
+    for (size_t j = i; j < i + n; j++)
+      messages.push_back(out[j]->data());
 
-    tx_.send(message, flag);
+    send(batch::join(std::move(messages)));
+    kiq::log::klog().t("Sent batch of {} replies", n);
+  }
+}
+//----------------------------------
+void server::expire()
+{
+  std::vector<pending_entry> expired;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_.expire(pending_entry::clock_t::now(), [&expired](pending_entry&& e) { expired.push_back(std::move(e)); });
   }
 
-  kiq::log::klog().t("Sent reply of {} as response to {}", constants::IPC_MESSAGE_NAMES.at(msg->type()), req.id);
+  outstanding_ -= expired.size();
+  expired_     += expired.size();
+  stats().expired.add(expired.size());
+  for (const auto& entry : expired)
+  {
+    kiq::log::klog().w("Request {} timed out after {} ms. Replying with failure", entry.id, entry.total<std::chrono::milliseconds>());
+    enqueue(make_reply(entry.id, false));
+  }
+}
+//----------------------------------
+// Fails a request at once rather than queueing it beyond the credit window. It is not
+// marked as processed, so kiq may resend it once credit is granted.
+void server::reject(const ipc_msg_t& msg)
+{
+  const auto id = msg->type() == constants::IPC_PLATFORM_INFO ? static_cast<platform_info*>   (msg.get())->type() :
+                                                                 static_cast<platform_message*>(msg.get())->id();
+  kiq::log::klog().w("Rejecting request {}: {} requests outstanding", id, outstanding_.load());
+  stats().rejected.add();
+  if (!busy_)
+  {
+    busy_ = true;
+    enqueue(make_credit("matrix:busy", 0, outstanding_));
+  }
+  enqueue(make_reply(id, false));
 }
+//----------------------------------
+void server::grant()
+{
+  const size_t depth = outstanding_;
+  if (!busy_ || depth > options_.max_pending / 2)
+    return;
 
+  busy_ = false;
+  enqueue(make_credit("matrix:credit", options_.max_pending - depth, depth));
+}
+//----------------------------------
 void server::run()
 {
+  zmq::pollitem_t items[] = {{rx_.handle(), 0, ZMQ_POLLIN, 0}, {nullptr, outbox_fd_, ZMQ_POLLIN, 0}};
+
+  if (worker_)
+    control(worker::g_ready);
+
   while (active_)
-    recv();
+  {
+    auto timeout = std::chrono::milliseconds(g_recv_timeout_ms);
+    {
+      std::lock_guard<std::mutex> lock(outbox_mutex_);
+      if (!outbox_.empty())
+        timeout = std::clamp(std::chrono::ceil<std::chrono::milliseconds>(
+                    outbox_since_ + options_.reply_window - clock_t::now()), std::chrono::milliseconds(0), timeout);
+    }
+
+    zmq::poll(items, 2, timeout);
+
+    if (items[0].revents & ZMQ_POLLIN)
+      recv();
+
+    if (items[1].revents & ZMQ_POLLIN)
+    {
+      uint64_t count;
+      while (read(outbox_fd_, &count, sizeof(count)) > 0) ;
+    }
+
+    flush();
+    expire();
+    grant();
+
+    if (worker_ && clock_t::now() - beat_ >= options_.heartbeat)
+      control(worker::g_heartbeat);
+  }
+
+  if (worker_)
+    control(worker::g_leave);
 }
 //----------------------------------
 void server::recv()
 {
-  using namespace kutils;
-  using buffers_t = std::vector<ipc_message::byte_buffer>;
-
-  auto is_duplicate = [this](const auto& m) { for (const auto& id : processed_) if (id == m->id()) return true; // match
-                                              return false; };                                                  // no match
   zmq::message_t identity;
-  if (!rx_.recv(identity) || identity.empty())
-    return kiq::log::klog().e("Socket failed to receive");
+  if (!worker_)                           // A worker's DEALER has no identity frame
+  {
+    if (!rx_.recv(identity))
+      return; // timed out
+    if (identity.empty())
+      return kiq::log::klog().e("Socket failed to receive");
+  }
 
+  const auto     received = clock_t::now();
   buffers_t      buffer;
   zmq::message_t msg;
   int            more_flag{1};
 
+  buffer.reserve(frame_hint_);
   while (more_flag && rx_.recv(msg))
   {
     more_flag = rx_.get(zmq::sockopt::rcvmore);
-    buffer.push_back({static_cast<char*>(msg.data()), static_cast<char*>(msg.data()) + msg.size()});
+    buffer.emplace_back(msg.data<uint8_t>(), msg.data<uint8_t>() + msg.size());
   }
+  frame_hint_ = std::max(frame_hint_, buffer.size());
+  if (buffer.empty())
+    return;
+
+  if (!batch::is_batch(buffer))
+    return ingest(std::move(buffer), received);
+
+  auto messages = batch::split(std::move(buffer));
+  if (messages.empty())
+    return kiq::log::klog().e("Received malformed batch");
+
+  batch_peer_ = true;
+  kiq::log::klog().t("Received batch of {} messages", messages.size());
+  for (auto& frames : messages)
+    ingest(std::move(frames), received);
+}
+//----------------------------------
+void server::ingest(buffers_t&& frames, pending_entry::time_point received)
+{
+  using namespace kutils;
 
-  ipc_msg_t   ipc_msg = DeserializeIPCMessage(std::move(buffer));
+  ipc_msg_t   ipc_msg = DeserializeIPCMessage(std::move(frames));
   kiq::log::klog().t("Message type is {}", constants::IPC_MESSAGE_NAMES.at(ipc_msg->type()));
 
+  const bool request = ipc_msg->type() == constants::IPC_PLATFORM_TYPE || ipc_msg->type() == constants::IPC_PLATFORM_INFO;
+  if (request && outstanding_ >= options_.max_pending)
+    return reject(ipc_msg);
+
   if (ipc_msg->type() == constants::IPC_PLATFORM_TYPE)
   {
-    if (const auto decoded = static_cast<platform_message*>(ipc_msg.get()); is_duplicate(decoded))
+    if (const auto decoded = static_cast<platform_message*>(ipc_msg.get()); !processed_.insert(decoded->id()))
     {
       kiq::log::klog().w("Ignoring duplicate IPC message");
+      stats().duplicates.add();
       return;
     }
-    else
-      processed_.push_back(decoded->id());
   }
 
-  msgs_.push_back(std::move(ipc_msg));
+  outstanding_++;
+  stats().received.add();
+  inbound_t in{std::move(ipc_msg), received};
+  for (bool warned = false; !msgs_.push(std::move(in)); warned = true)
+  {
+    if (!active_)
+      return;
+    if (!warned)
+      kiq::log::klog().w("Message queue full. Waiting on consumer");
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  notify();
 }
 } // ns kiq::katrix
@@ -1,13 +1,30 @@
+#pragma once
+
+#include <atomic>
 #include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
 #include <kutils.hpp>
 #include <kproto/ipc.hpp>
-#include <variant>
+#include "ring.hpp"
+#include "dedupe.hpp"
+#include "pending.hpp"
 
 //----------------------------------------------------------------
 namespace kiq::katrix
 {
 using ipc_msg_t = ipc_message::u_ipc_msg_ptr;
 //-------------------------------------------------------------
+enum class priority_t : uint8_t
+{
+  urgent,
+  normal,
+  bulk
+};
+// Move-only: each request is built once from its IPC message and then moved, never
+// copied, through to the queued send.
+//-------------------------------------------------------------
 struct request_t
 {
   std::string id;
@@ -15,54 +32,118 @@ struct request_t
   std::string text;
   std::string media;
   std::string time;
+  std::string room;
+  priority_t  priority{priority_t::normal};
   bool        info{false};
+
+  request_t()                            = default;
+  request_t(request_t&&)                 = default;
+  request_t& operator=(request_t&&)      = default;
+  request_t(const request_t&)            = delete;
+  request_t& operator=(const request_t&) = delete;
 };
 //-------------------------------------------------------------
-using ipc_var_t     = std::variant<kiq::platform_message, kiq::platform_info>;
 class request_converter
 {
 public:
   request_converter() = default;
-  request_t receive(ipc_msg_t msg);
-
-private:
-using msg_handler_t = std::function<void(ipc_msg_t)>;
-using dispatch_t    = std::map<uint8_t, msg_handler_t>;
-
-  void on_request(ipc_var_t);
-
-  request_t  req;
-  dispatch_t m_dispatch_table{
-    {constants::IPC_KIQ_MESSAGE,   [this](ipc_msg_t msg) {                             }},
-    {constants::IPC_PLATFORM_TYPE, [this](ipc_msg_t msg) { on_request(*(static_cast<platform_message*>(msg.get()))); }},
-    {constants::IPC_PLATFORM_INFO, [this](ipc_msg_t msg) { on_request(*(static_cast<platform_info*>   (msg.get()))); }}
-  };
+  std::optional<request_t> receive(ipc_msg_t msg) const;
 }; // request_converter
 //-------------------------------------------------------------
+struct server_options
+{
+  std::string               rx_addr        {"tcp://0.0.0.0:28477"};
+  std::string               tx_addr        {"tcp://0.0.0.0:28478"};
+  size_t                    dedupe_capacity{65536};
+  std::chrono::seconds      dedupe_window  {std::chrono::hours(24)};
+  std::chrono::seconds      request_ttl    {std::chrono::minutes(15)};
+  size_t                    max_pending    {1024};
+  int                       rx_hwm         {1000};
+  int                       tx_hwm         {1000};
+  bool                      batch_replies  {false};
+  size_t                    reply_batch    {64};
+  std::chrono::milliseconds reply_window   {2};
+  std::string               broker_addr;       // Set to serve a broker as one of its workers
+  std::string               worker_id;         // Defaults to <hostname>.<pid>
+  std::chrono::milliseconds heartbeat      {1000};
+};
+//-------------------------------------------------------------
+// Replies are queued and written by the server thread alone. When batching is on (by
+// option, or once kiq has sent a batch itself) replies are held for up to reply_window
+// and sent reply_batch at a time in one batch envelope.
+//
+// Flow control: at most max_pending requests are held between receipt and reply. Past
+// that, requests are failed at once and kiq is sent a "matrix:busy" platform_info; a
+// "matrix:credit" info carrying {"credit", "depth"} follows once half the window frees.
+//
+// As a broker's worker, one DEALER connected to the broker carries requests in and
+// replies out, with heartbeats while it is otherwise quiet.
+//-------------------------------------------------------------
 class server
 {
-using msg_id_t = std::string;
+using msg_id_t  = std::string;
+using buffers_t = std::vector<ipc_message::byte_buffer>;
+using clock_t   = pending_entry::clock_t;
+struct inbound_t
+{
+  ipc_msg_t                 msg;
+  pending_entry::time_point received;
+};
 public:
-  server();
+  server(const server_options& options = {});
   ~server();
 
   bool      is_active()                    const;
   bool      has_msgs ()                    const;
   void      reply    (const request_t& req, bool success = true);
+  void      reply    (const std::string& id, bool success, const std::string& text = "");
   ipc_msg_t get_msg  ();
+  int       fd       ()                    const;
+  void      clear    ();
+  size_t    depth    ()                    const;
+  size_t    queued   ()                    const;
+  size_t    pending  ();
+  uint64_t  expired  ()                    const;
+  bool      is_pending(const std::string& id);
+  // For peers in the same process, which must share it to use inproc:// addresses
+  zmq::context_t& context();
 
 private:
   void run();
 
   void recv();
+  void ingest(buffers_t&& frames, pending_entry::time_point received);
+  void notify();
+  void expire();
+  void reject(const ipc_msg_t& msg);
+  void grant();
+  void enqueue(ipc_msg_t msg);
+  void flush();
+  void send(const ipc_msg_t& msg);
+  void send(buffers_t&& frames);
+  void control(std::string_view verb);
 
   zmq::context_t                context_;
   zmq::socket_t                 rx_;
   zmq::socket_t                 tx_;
   std::future<void>             future_;
-  bool                          active_{true};
-  std::deque<ipc_msg_t>         msgs_;
-  std::vector<std::string>      processed_;
-  std::map<msg_id_t, ipc_msg_t> pending_;
+  std::atomic<bool>             active_{true};
+  ring<inbound_t>               msgs_;
+  int                           wake_fd_;
+  dedupe_index                  processed_;
+  pending_table                 pending_;
+  std::mutex                    pending_mutex_;
+  size_t                        frame_hint_{0};
+  server_options                options_;
+  std::atomic<size_t>           outstanding_{0};
+  std::atomic<uint64_t>         expired_{0};
+  bool                          busy_{true};
+  std::atomic<bool>             batch_peer_{false};
+  std::vector<ipc_msg_t>        outbox_;
+  std::mutex                    outbox_mutex_;
+  int                           outbox_fd_;
+  clock_t::time_point           outbox_since_;
+  bool                          worker_;
+  clock_t::time_point           beat_;
 }; // server
 } // ns kiq::katrix
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <nlohmann/json.hpp>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Writes to a sibling temp file and renames it over the target, so a crash mid-write
+// leaves the previous contents intact. Files are readable by the owner only: the
+// session file holds an access token. With `durable`, the data reaches the disk before
+// the rename, so the file survives a host crash too.
+//-------------------------------------------------------------
+inline bool write_file(const std::string& path, const std::string& data, bool durable = false)
+{
+  const auto tmp = path + ".tmp";
+  const int  fd  = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return false;
+
+  bool ok = ::fchmod(fd, 0600) == 0;      // A stale temp file keeps its old mode
+  for (size_t done = 0; ok && done < data.size();)
+  {
+    const auto n = ::write(fd, data.data() + done, data.size() - done);
+    ok    = n > 0;
+    done += ok ? n : 0;
+  }
+  ok = ok && (!durable || ::fdatasync(fd) == 0);
+  ok = (::close(fd) == 0) && ok;
+  return ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+//-------------------------------------------------------------
+inline nlohmann::json read_json(const std::string& path)
+{
+  std::ifstream file{path};
+  if (!file)
+    return nlohmann::json{};
+  return nlohmann::json::parse(file, nullptr, false);
+}
+//-------------------------------------------------------------
+struct session
+{
+  std::string user_id;
+  std::string device_id;
+  std::string access_token;
+  std::string next_batch;
+  std::string filter_id;
+  std::string filter;     // Definition filter_id was created from
+//------------------------------------
+  bool valid() const
+  {
+    return !access_token.empty() && !user_id.empty();
+  }
+//------------------------------------
+  static session load(const std::string& path)
+  {
+    session s;
+    if (path.empty())
+      return s;
+
+    if (const auto json = read_json(path); json.is_object())
+    {
+      s.user_id      = json.value("user_id",      "");
+      s.device_id    = json.value("device_id",    "");
+      s.access_token = json.value("access_token", "");
+      s.next_batch   = json.value("next_batch",   "");
+      s.filter_id    = json.value("filter_id",    "");
+      s.filter       = json.value("filter",       "");
+    }
+    return s;
+  }
+//------------------------------------
+  bool save(const std::string& path) const
+  {
+    if (path.empty())
+      return false;
+
+    return write_file(path, nlohmann::json{
+      {"user_id",      user_id},
+      {"device_id",    device_id},
+      {"access_token", access_token},
+      {"next_batch",   next_batch},
+      {"filter_id",    filter_id},
+      {"filter",       filter}}.dump());
+  }
+};
+} // ns kiq::katrix
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "intern.hpp"
+#include "flat_table.hpp"
+
+namespace kiq::katrix
+{
+enum class membership_t : uint8_t
+{
+  none,
+  join,
+  invite,
+  knock,
+  ban
+};
+//-------------------------------------------------------------
+// Room and member state of joined rooms, kept up to date from sync deltas. Room ids,
+// user ids, names and aliases are interned once; rooms live in a dense array reached
+// through flat tables keyed by id, so each lookup is a hash and an index.
+//-------------------------------------------------------------
+class state_store
+{
+public:
+using id_t = interner::id_t;
+static constexpr id_t g_none{interner::g_none};
+
+struct room_state
+{
+  id_t                                  id             {g_none};
+  id_t                                  name           {g_none};
+  id_t                                  canonical_alias{g_none};
+  std::vector<id_t>                     aliases;       // Canonical first, then alternates and published
+  std::vector<std::pair<id_t, int32_t>> powers;        // Users with an explicit power level
+  int32_t                               power_default  {0};
+  uint32_t                              joined         {0};
+};
+//------------------------------------
+  // Returns the room, adding it if new. References are invalidated by the next add.
+  room_state& room(std::string_view id)
+  {
+    const id_t key = ids_.intern(id);
+    if (const auto slot = index_.find(key))
+      return rooms_[*slot];
+
+    uint32_t slot;
+    if (free_.empty())
+    {
+      slot = static_cast<uint32_t>(rooms_.size());
+      rooms_.emplace_back();
+    }
+    else
+    {
+      slot = free_.back();
+      free_.pop_back();
+    }
+
+    rooms_[slot]    = room_state{};
+    rooms_[slot].id = key;
+    index_[key]     = slot;
+    version_++;
+    return rooms_[slot];
+  }
+//------------------------------------
+  const room_state* find(std::string_view id) const
+  {
+    const auto slot = index_.find(ids_.find(id));
+    return slot ? &rooms_[*slot] : nullptr;
+  }
+//------------------------------------
+  void remove(std::string_view id)
+  {
+    const id_t key  = ids_.find(id);
+    const auto slot = index_.find(key);
+    if (!slot)
+      return;
+
+    room_state& room = rooms_[*slot];
+    for (const auto alias : room.aliases)
+      unindex_alias(alias, *slot);
+
+    std::vector<flat_table<membership_t>::key_t> members;
+    members_.for_each([key, &members](auto k, auto) { if ((k >> 32) == key) members.push_back(k); });
+    for (const auto k : members)
+      members_.erase(k);
+
+    room = room_state{};
+    free_.push_back(*slot);
+    index_.erase(key);
+    version_++;
+  }
+//------------------------------------
+  void set_name(room_state& room, std::string_view name)
+  {
+    room.name = name.empty() ? g_none : ids_.intern(name);
+    version_++;
+  }
+//------------------------------------
+  // Replaces the room's alias list; the canonical alias, if any, is kept first
+  void set_aliases(room_state& room, const std::vector<std::string>& aliases)
+  {
+    const uint32_t slot = slot_of(room);
+    for (const auto alias : room.aliases)
+      unindex_alias(alias, slot);
+
+    room.aliases.clear();
+    if (room.canonical_alias != g_none)
+      room.aliases.push_back(room.canonical_alias);
+    for (const auto& alias : aliases)
+      if (const id_t id = ids_.intern(alias); std::find(room.aliases.begin(), room.aliases.end(), id) == room.aliases.end())
+        room.aliases.push_back(id);
+
+    for (const auto alias : room.aliases)
+      aliases_[alias] = slot;
+    version_++;
+  }
+//------------------------------------
+  void set_canonical_alias(room_state& room, std::string_view alias, const std::vector<std::string>& alternates = {})
+  {
+    room.canonical_alias = alias.empty() ? g_none : ids_.intern(alias);
+    set_aliases(room, alternates);
+  }
+//------------------------------------
+  // Records an alias seen outside sync (the alias cache, a directory lookup) without
+  // adding its room. Aliases of joined rooms take precedence.
+  void remember_alias(std::string_view alias, std::string_view room)
+  {
+    known_[ids_.intern(alias)] = ids_.intern(room);
+  }
+//------------------------------------
+  void set_membership(room_state& room, std::string_view user, membership_t membership)
+  {
+    const auto key     = member_key(room.id, ids_.intern(user));
+    const auto current = members_.find(key);
+    const bool joined  = current && *current == membership_t::join;
+
+    if (membership == membership_t::none)
+      members_.erase(key);
+    else
+      members_[key] = membership;
+
+    if (joined && membership != membership_t::join)
+      room.joined--;
+    else
+    if (!joined && membership == membership_t::join)
+      room.joined++;
+  }
+//------------------------------------
+  void set_powers(room_state& room, int32_t users_default, std::vector<std::pair<std::string, int32_t>>&& users)
+  {
+    room.power_default = users_default;
+    room.powers.clear();
+    room.powers.reserve(users.size());
+    for (const auto& [user, level] : users)
+      room.powers.emplace_back(ids_.intern(user), level);
+  }
+//------------------------------------
+  membership_t membership(std::string_view room, std::string_view user) const
+  {
+    const id_t room_id = ids_.find(room), user_id = ids_.find(user);
+    if (room_id == g_none || user_id == g_none)
+      return membership_t::none;
+
+    const auto value = members_.find(member_key(room_id, user_id));
+    return value ? *value : membership_t::none;
+  }
+//------------------------------------
+  int32_t power(const room_state& room, std::string_view user) const
+  {
+    const id_t id = ids_.find(user);
+    for (const auto& [uid, level] : room.powers)
+      if (uid == id)
+        return level;
+    return room.power_default;
+  }
+//------------------------------------
+  // The bot's own user, whose membership joined() reports
+  void set_self(std::string_view user)
+  {
+    self_ = ids_.intern(user);
+  }
+//------------------------------------
+  bool joined(std::string_view room) const
+  {
+    const id_t id = ids_.find(room);
+    if (id == g_none || self_ == g_none)
+      return false;
+
+    const auto value = members_.find(member_key(id, self_));
+    return value && *value == membership_t::join;
+  }
+//------------------------------------
+  // Returns the id of the room an alias belongs to, or an empty view
+  std::string_view room_for_alias(std::string_view alias) const
+  {
+    const id_t key = ids_.find(alias);
+    if (const auto slot = aliases_.find(key))
+      return ids_.view(rooms_[*slot].id);
+
+    const auto room = known_.find(key);
+    return room ? ids_.view(*room) : std::string_view{};
+  }
+//------------------------------------
+  template <typename F>
+  void for_each_room(F&& fn) const
+  {
+    for (const auto& room : rooms_)
+      if (room.id != g_none)
+        fn(room);
+  }
+//------------------------------------
+  std::string_view view   (id_t id) const { return ids_.view(id);     }
+  size_t           rooms   ()        const { return index_.size();     }
+  size_t           members ()        const { return members_.size();   }
+  uint64_t         version ()        const { return version_;          } // Bumped when rooms, names or aliases change
+  size_t           bytes   ()        const
+  {
+    size_t n = ids_.bytes() + index_.bytes() + aliases_.bytes() + known_.bytes() + members_.bytes() + rooms_.capacity() * sizeof(room_state);
+    for (const auto& room : rooms_)
+      n += room.aliases.capacity() * sizeof(id_t) + room.powers.capacity() * sizeof(room.powers[0]);
+    return n;
+  }
+//------------------------------------
+private:
+  static flat_table<membership_t>::key_t member_key(id_t room, id_t user)
+  {
+    return (uint64_t{room} << 32) | user;
+  }
+//------------------------------------
+  uint32_t slot_of(const room_state& room) const
+  {
+    return static_cast<uint32_t>(&room - rooms_.data());
+  }
+//------------------------------------
+  void unindex_alias(id_t alias, uint32_t slot)
+  {
+    if (const auto owner = aliases_.find(alias); owner && *owner == slot)
+      aliases_.erase(alias);
+  }
+//------------------------------------
+  interner                 ids_;
+  std::vector<room_state>  rooms_;
+  std::vector<uint32_t>    free_;
+  flat_table<uint32_t>     index_;   // Room id   -> slot
+  flat_table<uint32_t>     aliases_; // Alias id  -> slot
+  flat_table<id_t>         known_;   // Alias id  -> room id, for rooms not (yet) synced
+  flat_table<membership_t> members_; // Room id << 32 | user id -> membership
+  id_t                     self_{g_none};
+  uint64_t                 version_{0};
+};
+} // ns kiq::katrix
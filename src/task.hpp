@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Move-only void() callable, so queued work may own move-only state such as request_t
+//-------------------------------------------------------------
+class task
+{
+  struct base
+  {
+    virtual ~base() = default;
+    virtual void operator()() = 0;
+  };
+
+  template <typename F>
+  struct impl : base
+  {
+    impl(F f) : fn(std::move(f)) {}
+    void operator()() override { fn(); }
+    F fn;
+  };
+//------------------------------------
+public:
+  task() = default;
+
+  template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, task>>>
+  task(F&& fn)
+  : fn_(std::make_unique<impl<std::decay_t<F>>>(std::forward<F>(fn)))
+  {}
+
+  task(task&&)            = default;
+  task& operator=(task&&) = default;
+
+  void operator()()             { (*fn_)();                      }
+  explicit operator bool() const { return static_cast<bool>(fn_); }
+//------------------------------------
+private:
+  std::unique_ptr<base> fn_;
+};
+} // ns kiq::katrix
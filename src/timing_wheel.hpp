@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+// Hierarchical timing wheel. Four levels of 256 slots each give O(1) insertion and
+// expiry over 2^32 ticks; items further out are parked in the top level and re-placed
+// when it cascades. Removal is lazy: callers should check an expired item still matters.
+//-------------------------------------------------------------
+template <typename T, typename Clock = std::chrono::steady_clock>
+class timing_wheel
+{
+using time_point = typename Clock::time_point;
+using duration_t = typename Clock::duration;
+static constexpr size_t   g_bits  {8};
+static constexpr size_t   g_slots {size_t{1} << g_bits};
+static constexpr size_t   g_levels{4};
+static constexpr uint64_t g_mask  {g_slots - 1};
+static constexpr uint64_t g_range {uint64_t{1} << (g_bits * g_levels)};
+
+struct item
+{
+  uint64_t tick;
+  T        value;
+};
+using slot_t = std::vector<item>;
+//------------------------------------
+public:
+  explicit timing_wheel(duration_t resolution, time_point origin = Clock::now())
+  : resolution_(resolution),
+    origin_    (origin)
+  {}
+//------------------------------------
+  void add(time_point when, T value)
+  {
+    const uint64_t tick = to_tick(when);
+    place(item{(tick > current_) ? tick : current_ + 1, std::move(value)});
+    size_++;
+  }
+//------------------------------------
+  // Invokes fn(T&&) for every item due at or before `now`
+  template <typename F>
+  void advance(time_point now, F&& fn)
+  {
+    const uint64_t target = to_tick(now);
+    while (size_ && current_ < target)
+      tick(fn);
+
+    if (!size_ && current_ < target)
+      current_ = target;
+  }
+//------------------------------------
+  size_t     size      () const { return size_;       }
+  bool       empty     () const { return !size_;      }
+  duration_t resolution() const { return resolution_; }
+//------------------------------------
+private:
+  uint64_t to_tick(time_point t) const
+  {
+    return (t <= origin_) ? 0 : static_cast<uint64_t>((t - origin_) / resolution_);
+  }
+//------------------------------------
+  void place(item&& i)
+  {
+    const uint64_t delta = std::min(i.tick - current_, g_range - 1);
+    size_t level{0};
+    while (level < g_levels - 1 && delta >= (uint64_t{1} << (g_bits * (level + 1))))
+      level++;
+
+    const uint64_t tick = (i.tick - current_ == delta) ? i.tick : current_ + delta;
+    wheels_[level][(tick >> (g_bits * level)) & g_mask].push_back(std::move(i));
+  }
+//------------------------------------
+  template <typename F>
+  void tick(F& fn)
+  {
+    current_++;
+
+    size_t top{0};
+    while (top < g_levels - 1 && !(current_ & ((uint64_t{1} << (g_bits * (top + 1))) - 1)))
+      top++;
+
+    for (size_t level = top; level > 0; level--)
+    {
+      slot_t items = std::move(wheels_[level][(current_ >> (g_bits * level)) & g_mask]);
+      wheels_[level][(current_ >> (g_bits * level)) & g_mask].clear();
+      for (auto& i : items)
+        place(std::move(i));
+    }
+
+    slot_t& slot = wheels_[0][current_ & g_mask];
+    if (slot.empty())
+      return;
+
+    slot_t items = std::move(slot);
+    slot.clear();
+    for (auto& i : items)
+    {
+      if (i.tick > current_)
+        place(std::move(i));
+      else
+      {
+        size_--;
+        fn(std::move(i.value));
+      }
+    }
+  }
+//------------------------------------
+  std::array<std::array<slot_t, g_slots>, g_levels> wheels_;
+  duration_t                                        resolution_;
+  time_point                                        origin_;
+  uint64_t                                          current_{0};
+  size_t                                            size_   {0};
+};
+} // ns kiq::katrix
@@ -0,0 +1,229 @@
+#include "upload.hpp"
+#include <algorithm>
+#include <logger.hpp>
+#include <nlohmann/json.hpp>
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+struct reader_t
+{
+  int   fd;
+  off_t offset;
+};
+//----------------------------------
+static size_t read_chunk(char* buffer, size_t size, size_t count, void* data)
+{
+  auto*         reader = static_cast<reader_t*>(data);
+  const ssize_t result = pread(reader->fd, buffer, size * count, reader->offset);
+  if (result < 0)
+    return CURL_READFUNC_ABORT;
+
+  reader->offset += result;
+  return static_cast<size_t>(result);
+}
+//----------------------------------
+static size_t write_body(char* buffer, size_t size, size_t count, void* data)
+{
+  static_cast<std::string*>(data)->append(buffer, size * count);
+  return size * count;
+}
+//----------------------------------
+static std::optional<mtx::http::ClientError> make_error(int status, int code, const std::string& body)
+{
+  mtx::http::ClientError error{};
+  error.status_code = status;
+  error.error_code  = code;
+  if (const auto json = nlohmann::json::parse(body, nullptr, false); json.is_object())
+    try { error.matrix_error = json.get<mtx::errors::Error>(); } catch (...) {}
+  return error;
+}
+//-------------------------------------------------------------
+static bool read_all(int fd, std::string& body, size_t size)
+{
+  body.resize(size);
+  for (size_t done = 0; done < size;)
+  {
+    const ssize_t n = pread(fd, body.data() + done, size - done, done);
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+//-------------------------------------------------------------
+stream_uploader::stream_uploader(const upload_options& options)
+: options_(options)
+{
+  static std::once_flag g_curl;
+  std::call_once(g_curl, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+  options_.chunk_size = std::max(options_.chunk_size, size_t{1});
+  for (size_t i = 0; i < std::max(options_.workers, size_t{1}); i++)
+    workers_.push_back(std::async(std::launch::async, [this] { work(); }));
+}
+//----------------------------------
+stream_uploader::~stream_uploader()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_ = false;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_)
+    worker.wait();
+}
+//----------------------------------
+void stream_uploader::submit(job j)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(std::move(j));
+  }
+  cv_.notify_all();                             // Workers waiting on the budget share cv_
+}
+//----------------------------------
+size_t stream_uploader::pending() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return jobs_.size();
+}
+//----------------------------------
+const upload_options& stream_uploader::options() const
+{
+  return options_;
+}
+//----------------------------------
+void stream_uploader::work()
+{
+  for (;;)
+  {
+    job j;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return !active_ || !jobs_.empty(); });
+      if (!active_)
+        return;
+      j = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    perform(j);
+  }
+}
+//----------------------------------
+bool stream_uploader::reserve(size_t bytes)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, bytes] { return !active_ || !inflight_ || inflight_ + bytes <= options_.max_inflight; });
+  if (!active_)
+    return false;
+  inflight_ += bytes;
+  return true;
+}
+//----------------------------------
+void stream_uploader::release(size_t bytes)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    inflight_ -= bytes;
+  }
+  cv_.notify_all();
+}
+//----------------------------------
+void stream_uploader::perform(const job& j)
+{
+  const int fd = open(j.path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0)
+  {
+    kiq::log::klog().e("Failed to open {} for upload", j.path);
+    if (fd >= 0)
+      close(fd);
+    return j.callback({}, make_error(0, CURLE_READ_ERROR, ""));
+  }
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  const auto size   = static_cast<size_t>(info.st_size);
+  const bool stream = size >= options_.stream_threshold;
+  const auto cost   = stream ? std::min(size, options_.chunk_size) : size;
+  if (!reserve(cost))                           // Shutting down
+  {
+    close(fd);
+    return;
+  }
+
+  std::string body;
+  if (!stream && !read_all(fd, body, size))
+  {
+    kiq::log::klog().e("Failed to read {} for upload", j.path);
+    close(fd);
+    release(cost);
+    return j.callback({}, make_error(0, CURLE_READ_ERROR, ""));
+  }
+
+  kiq::log::klog().d("{} {} bytes from {}", stream ? "Streaming" : "Uploading", size, j.path);
+
+  CURL*       curl     = curl_easy_init();
+  char*       filename = curl_easy_escape(curl, j.filename.c_str(), j.filename.size());
+  const auto  url      = j.server + "/_matrix/media/v3/upload?filename=" + filename;
+  curl_slist* headers  = nullptr;
+  reader_t    reader{fd, 0};
+  std::string response;
+  long        status{0};
+  curl_free(filename);
+
+  headers = curl_slist_append(headers, ("Authorization: Bearer " + j.token).c_str());
+  headers = curl_slist_append(headers, ("Content-Type: "         + j.mime ).c_str());
+
+  curl_easy_setopt(curl, CURLOPT_URL,                 url.c_str());
+  curl_easy_setopt(curl, CURLOPT_POST,                1L);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER,          headers);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(size));
+  if (stream)
+  {
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION,      &read_chunk);
+    curl_easy_setopt(curl, CURLOPT_READDATA,          &reader);
+    curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, static_cast<long>(options_.chunk_size));
+  }
+  else
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS,        body.data());
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,       &write_body);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA,           &response);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL,            1L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT,      static_cast<long>(options_.connect_timeout.count()));
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT,     static_cast<long>(options_.low_speed_limit));
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,      static_cast<long>(options_.low_speed_time.count()));
+  if (!options_.verify_tls)
+  {
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER,    0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST,    0L);
+  }
+
+  const CURLcode code = curl_easy_perform(curl);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  curl_slist_free_all(headers);
+  curl_easy_cleanup(curl);
+  close(fd);
+  std::string{}.swap(body);
+  release(cost);
+
+  if (code != CURLE_OK || status != 200)
+  {
+    kiq::log::klog().e("Upload of {} failed. HTTP {} curl {}", j.path, status, static_cast<int>(code));
+    return j.callback({}, make_error(status, code, response));
+  }
+
+  mtx::responses::ContentURI uri;
+  if (const auto json = nlohmann::json::parse(response, nullptr, false); json.is_object())
+    uri.content_uri = json.value("content_uri", "");
+
+  if (uri.content_uri.empty())
+    return j.callback({}, make_error(status, CURLE_OK, response));
+
+  j.callback(uri, {});
+}
+} // ns kiq::katrix
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "mtx.hpp"
+#include "mtxclient/http/errors.hpp"
+
+namespace kiq::katrix
+{
+//-------------------------------------------------------------
+struct upload_options
+{
+  size_t               stream_threshold{size_t{8}   << 20}; // Files at least this size are streamed
+  size_t               chunk_size      {size_t{256} << 10}; // Bytes read from disk per transfer chunk
+  size_t               max_inflight    {size_t{4}   << 20}; // Total upload memory shared by all transfers
+  size_t               workers         {2};                 // Concurrent transfers
+  std::chrono::seconds connect_timeout {10};
+  size_t               low_speed_limit {1024};              // A transfer slower than this, in bytes per second,...
+  std::chrono::seconds low_speed_time  {30};                // ...for this long is abandoned
+  bool                 verify_tls      {true};
+};
+//-------------------------------------------------------------
+// Uploads files to the media repository off the event loop. Files below stream_threshold
+// are read whole; larger ones are read from disk a chunk at a time. Either way a transfer
+// first reserves the memory it will hold, its file size or one chunk, from a budget of
+// max_inflight bytes, and waits while the budget is spent. A file larger than the whole
+// budget goes once nothing else is in flight.
+//
+// A transfer that cannot connect within connect_timeout, or stalls below low_speed_limit
+// for low_speed_time, fails through its callback, so a dead connection cannot hold a
+// worker and its share of the budget.
+//-------------------------------------------------------------
+class stream_uploader
+{
+public:
+  using callback_t = std::function<void(mtx::responses::ContentURI, mtx::http::RequestErr)>;
+  struct job
+  {
+    std::string path;
+    std::string filename;
+    std::string mime;
+    std::string server;
+    std::string token;
+    callback_t  callback;
+  };
+
+  stream_uploader(const upload_options& options = {});
+  ~stream_uploader();
+
+  void                  submit (job j);
+  size_t                pending() const;
+  const upload_options& options() const;
+
+private:
+  void work   ();
+  void perform(const job& j);
+  bool reserve(size_t bytes);
+  void release(size_t bytes);
+
+  upload_options                 options_;
+  mutable std::mutex             mutex_;
+  std::condition_variable        cv_;
+  std::deque<job>                jobs_;
+  std::vector<std::future<void>> workers_;
+  size_t                         inflight_{0};
+  bool                           active_{true};
+};
+} // ns kiq::katrix
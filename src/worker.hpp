@@ -0,0 +1,42 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//-------------------------------------------------------------
+// Control messages between a worker and the broker, sent over the worker's DEALER:
+//
+//   "KIQ_WORKER" | "ready" | "heartbeat" | "leave"
+//
+// A worker announces itself with "ready", sends "heartbeat" at least once a heartbeat
+// interval, and "leave" when it shuts down. Any other message is kiq traffic, relayed
+// unchanged: requests to the worker, replies from it.
+//-------------------------------------------------------------
+namespace kiq::katrix::worker
+{
+static constexpr std::string_view g_magic    {"KIQ_WORKER"};
+static constexpr std::string_view g_ready    {"ready"};
+static constexpr std::string_view g_heartbeat{"heartbeat"};
+static constexpr std::string_view g_leave    {"leave"};
+//-------------------------------------------------------------
+template <typename Buffer>
+std::vector<Buffer> make(std::string_view verb)
+{
+  return {Buffer(g_magic.begin(), g_magic.end()), Buffer(verb.begin(), verb.end())};
+}
+//-------------------------------------------------------------
+template <typename Buffer>
+bool is_control(const std::vector<Buffer>& frames)
+{
+  return frames.size() == 2 && frames.front().size() == g_magic.size() &&
+         std::equal(g_magic.begin(), g_magic.end(), reinterpret_cast<const char*>(frames.front().data()));
+}
+//-------------------------------------------------------------
+template <typename Buffer>
+std::string_view verb(const std::vector<Buffer>& frames)
+{
+  return {reinterpret_cast<const char*>(frames[1].data()), frames[1].size()};
+}
+} // ns kiq::katrix::worker
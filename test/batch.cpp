@@ -0,0 +1,70 @@
+#include "batch.hpp"
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//-------------------------------------------------------------
+// Batch envelopes as a peer might send them, well formed or not. split() must reject the
+// malformed ones without throwing or reading past the frames it was given.
+//
+//   katrix_tests
+//-------------------------------------------------------------
+namespace kiq::katrix::test
+{
+using buffer_t  = std::vector<uint8_t>;
+using buffers_t = std::vector<buffer_t>;
+
+static int g_failures{0};
+//-------------------------------------------------------------
+static void check(bool passed, const std::string& name)
+{
+  if (!passed)
+    g_failures++;
+  std::cout << (passed ? "PASS " : "FAIL ") << name << '\n';
+}
+//-------------------------------------------------------------
+static buffers_t frames(std::initializer_list<std::string> parts)
+{
+  buffers_t result;
+  for (const auto& part : parts)
+    result.push_back(batch::make_frame<buffer_t>(part));
+  return result;
+}
+//-------------------------------------------------------------
+static bool rejected(buffers_t&& envelope)
+{
+  try
+  {
+    return batch::split(std::move(envelope)).empty();
+  }
+  catch (const std::exception&)
+  {
+    return false;
+  }
+}
+//-------------------------------------------------------------
+static void run()
+{
+  const auto messages = batch::split(frames({"KIQ_BATCH", "2", "1", "a", "2", "b", "c"}));
+  check(messages.size() == 2 && messages[0].size() == 1 && messages[1].size() == 2, "split well formed");
+
+  const auto joined = batch::split(batch::join(std::vector<buffers_t>{frames({"a"}), frames({"b", "c"})}));
+  check(joined == messages, "join round trip");
+
+  check(rejected(frames({"KIQ_BATCH", "99999999999999"})),               "huge message count");
+  check(rejected(frames({"KIQ_BATCH", "18446744073709551615"})),         "maximum message count");
+  check(rejected(frames({"KIQ_BATCH", "1", "18446744073709551615", "a"})), "frame count wraps");
+  check(rejected(frames({"KIQ_BATCH", "1", "2", "a"})),                  "frame count past the end");
+  check(rejected(frames({"KIQ_BATCH", "1", "0"})),                       "empty message");
+  check(rejected(frames({"KIQ_BATCH", "2", "1", "a"})),                  "missing message");
+  check(rejected(frames({"KIQ_BATCH", "x", "1", "a"})),                  "non-numeric count");
+  check(rejected(frames({"KIQ_BATCH"})),                                 "no count");
+}
+} // ns kiq::katrix::test
+//-------------------------------------------------------------
+int main()
+{
+  kiq::katrix::test::run();
+  return kiq::katrix::test::g_failures ? 1 : 0;
+}